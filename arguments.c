@@ -63,6 +63,9 @@ static void parse_configuration(char *, cmdline *, GPtrArray *);
 "  -b, --base DN          Search base.\n"				      \
 "  -s, --scope SCOPE      Search scope.  One of base|one|sub.\n"	      \
 "  -S, --sort KEYS        Sort control (critical).\n"			      \
+"      --paged SIZE       Fetch results in pages of SIZE entries.\n"	      \
+"      --parallel N       Search (and with -c, commit) on N connections.\n"   \
+"      --partition AD     (With --parallel:) Partition by values of AD.\n"    \
 "\n"									      \
 "Miscellaneous options:\n"						      \
 "      --add              (Only with --in, --ldapmodify:)\n"		      \
@@ -87,6 +90,11 @@ static void parse_configuration(char *, cmdline *, GPtrArray *);
 "  -Z, --starttls         Require startTLS.\n"				      \
 "      --tls [never|allow|try|strict]  Level of TLS strictess.\n"	      \
 "  -v, --verbose          Note every update.\n"				      \
+"      --window N         (With --continue:) Keep N updates in flight.\n"     \
+"      --transaction K    (With --continue:) Commit K updates at a time.\n"   \
+"      --max-rate R       Send at most R updates per second.\n"		      \
+"      --resume DIR       Continue the interrupted commit in DIR.\n"	      \
+"      --coalesce         (With --continue:) Merge modifications per entry.\n"\
 "\n"									      \
 "Shortcuts:\n"								      \
 "      --ldapsearch       Short for --quiet --out\n"			      \
@@ -120,7 +128,10 @@ enum ldapvi_option_numbers {
 	OPTION_NOQUESTIONS, OPTION_LDAPSEARCH, OPTION_LDAPMODIFY,
 	OPTION_LDAPDELETE, OPTION_LDAPMODDN, OPTION_LDAPMODRDN, OPTION_ADD,
 	OPTION_CONFIG, OPTION_READ, OPTION_LDAP_CONF, OPTION_BIND,
-	OPTION_BIND_DIALOG, OPTION_UNPAGED_HELP
+	OPTION_BIND_DIALOG, OPTION_UNPAGED_HELP, OPTION_PAGED,
+	OPTION_PARALLEL, OPTION_PARTITION, OPTION_WINDOW,
+	OPTION_TRANSACTION, OPTION_MAX_RATE, OPTION_RESUME,
+	OPTION_COALESCE
 };
 
 static struct poptOption options[] = {
@@ -140,6 +151,13 @@ static struct poptOption options[] = {
 	{"chase",	'C', POPT_ARG_STRING, 0, 'C', 0, 0},
 	{"deref",	'a', POPT_ARG_STRING, 0, 'a', 0, 0},
 	{"sort",	'S', POPT_ARG_STRING, 0, 'S', 0, 0},
+	{"paged",	  0, POPT_ARG_STRING, 0, OPTION_PAGED, 0, 0},
+	{"parallel",	  0, POPT_ARG_STRING, 0, OPTION_PARALLEL, 0, 0},
+	{"partition",	  0, POPT_ARG_STRING, 0, OPTION_PARTITION, 0, 0},
+	{"window",	  0, POPT_ARG_STRING, 0, OPTION_WINDOW, 0, 0},
+	{"transaction",	  0, POPT_ARG_STRING, 0, OPTION_TRANSACTION, 0, 0},
+	{"max-rate",	  0, POPT_ARG_STRING, 0, OPTION_MAX_RATE, 0, 0},
+	{"resume",	  0, POPT_ARG_STRING, 0, OPTION_RESUME, 0, 0},
 	{"class",	'o', POPT_ARG_STRING, 0, 'o', 0, 0},
 	{"read",	  0, POPT_ARG_STRING, 0, OPTION_READ, 0, 0},
 	{"profile",	'p', POPT_ARG_STRING, 0, 'p', 0, 0},
@@ -163,6 +181,7 @@ static struct poptOption options[] = {
 	{"add",		  0, 0, 0, OPTION_ADD, 0, 0},
 	{"config",	  0, 0, 0, OPTION_CONFIG, 0, 0},
 	{"noquestions",   0, 0, 0, OPTION_NOQUESTIONS, 0, 0},
+	{"coalesce",	  0, 0, 0, OPTION_COALESCE, 0, 0},
 	{"ldap-conf",     0, 0, 0, OPTION_LDAP_CONF, 0, 0},
 	{"ldif",	  0, 0, 0, OPTION_LDIF, 0, 0},
 	{"ldapvi",	  0, 0, 0, OPTION_LDAPVI, 0, 0},
@@ -213,6 +232,14 @@ init_cmdline(cmdline *cmdline)
 	cmdline->ldapmodify_add = 0;
 	cmdline->managedsait = 0;
 	cmdline->sortkeys = 0;
+	cmdline->pagesize = 0;
+	cmdline->parallel = 1;
+	cmdline->partition = 0;
+	cmdline->window = 1;
+	cmdline->transaction = 0;
+	cmdline->max_rate = 0;
+	cmdline->resume = 0;
+	cmdline->coalesce = 0;
 	cmdline->starttls = 0;
 	cmdline->tls = LDAP_OPT_X_TLS_TRY;
 	cmdline->deref = LDAP_DEREF_NEVER;
@@ -264,6 +291,22 @@ read_password_file(bind_options *bind_options, char *filename)
 	bind_options->password = data;
 }
 
+/*
+ * Return ARG, the value of option OPT, as a number between MIN and MAX.
+ */
+static int
+parse_positive(const char *opt, const char *arg, int min, int max)
+{
+	char *end;
+	long n = strtol(arg, &end, 10);
+
+	if (!*arg || *end || n < min || n > max) {
+		fprintf(stderr, "%s invalid: %s\n", opt, arg);
+		usage(2, 1);
+	}
+	return n;
+}
+
 static void
 parse_argument(int c, char *arg, cmdline *result, GPtrArray *ctrls)
 {
@@ -349,6 +392,32 @@ parse_argument(int c, char *arg, cmdline *result, GPtrArray *ctrls)
 	case 'S':
 		result->sortkeys = arg;
 		break;
+	case OPTION_PAGED:
+		result->pagesize = parse_positive("--paged", arg, 0, INT_MAX);
+		break;
+	case OPTION_PARALLEL:
+		result->parallel = parse_positive("--parallel", arg, 1, 256);
+		break;
+	case OPTION_PARTITION:
+		result->partition = arg;
+		break;
+	case OPTION_WINDOW:
+		result->window = parse_positive("--window", arg, 1, 4096);
+		break;
+	case OPTION_TRANSACTION:
+		result->transaction
+			= parse_positive("--transaction", arg, 0, INT_MAX);
+		break;
+	case OPTION_MAX_RATE:
+		result->max_rate
+			= parse_positive("--max-rate", arg, 0, INT_MAX);
+		break;
+	case OPTION_RESUME:
+		result->resume = arg;
+		break;
+	case OPTION_COALESCE:
+		result->coalesce = 1;
+		break;
 	case 'Z':
 		result->starttls = 1;
 		break;
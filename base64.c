@@ -52,70 +52,28 @@ static const char Base64[] =
 	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 static const char Pad64 = '=';
 
-void
-print_base64(
-	unsigned char const *src,
-	size_t srclength,
-	FILE *s)
-{
-	unsigned char input[3];
-	unsigned char output[4];
-	size_t i;
-	int col = 0;
-
-	while (2 < srclength) {
-		input[0] = *src++;
-		input[1] = *src++;
-		input[2] = *src++;
-		srclength -= 3;
-
-		output[0] = input[0] >> 2;
-		output[1] = ((input[0] & 0x03) << 4) + (input[1] >> 4);
-		output[2] = ((input[1] & 0x0f) << 2) + (input[2] >> 6);
-		output[3] = input[2] & 0x3f;
-
-		if (col >= 76) {
-			fputs("\n ", s);
-			col = 0;
-		}
-		col += 4;
-
-		fputc(Base64[output[0]], s);
-		fputc(Base64[output[1]], s);
-		fputc(Base64[output[2]], s);
-		fputc(Base64[output[3]], s);
-	}
-    
-	/* Now we worry about padding. */
-	if (0 != srclength) {
-		/* Get what's left. */
-		input[0] = input[1] = input[2] = '\0';
-		for (i = 0; i < srclength; i++)
-			input[i] = *src++;
-	
-		output[0] = input[0] >> 2;
-		output[1] = ((input[0] & 0x03) << 4) + (input[1] >> 4);
-		output[2] = ((input[1] & 0x0f) << 2) + (input[2] >> 6);
-
-		fputc(Base64[output[0]], s);
-		fputc(Base64[output[1]], s);
-		if (srclength == 1)
-			fputc(Pad64, s);
-		else
-			fputc(Base64[output[2]], s);
-		fputc(Pad64, s);
-	}
-}
-
-/* na toll, copy und paste von oben */
+/*
+ * Append the base64 encoding of SRC to STRING, folding lines the way
+ * LDIF does after every 76 characters.  The output is written directly
+ * into space reserved in STRING up front.
+ */
 void
 g_string_append_base64(
 	GString *string, unsigned char const *src, size_t srclength)
 {
+	size_t nfull = srclength / 3;
+	size_t nwraps = nfull ? (nfull - 1) / 19 : 0;
+	size_t start = string->len;
 	unsigned char input[3];
 	unsigned char output[4];
 	size_t i;
 	int col = 0;
+	char *ptr;
+
+	g_string_set_size(
+		string,
+		start + nfull * 4 + nwraps * 2 + (srclength % 3 ? 4 : 0));
+	ptr = string->str + start;
 
 	while (2 < srclength) {
 		input[0] = *src++;
@@ -129,15 +87,16 @@ g_string_append_base64(
 		output[3] = input[2] & 0x3f;
 
 		if (col >= 76) {
-			g_string_append(string, "\n ");
+			*ptr++ = '\n';
+			*ptr++ = ' ';
 			col = 0;
 		}
 		col += 4;
 
-		g_string_append_c(string, Base64[output[0]]);
-		g_string_append_c(string, Base64[output[1]]);
-		g_string_append_c(string, Base64[output[2]]);
-		g_string_append_c(string, Base64[output[3]]);
+		*ptr++ = Base64[output[0]];
+		*ptr++ = Base64[output[1]];
+		*ptr++ = Base64[output[2]];
+		*ptr++ = Base64[output[3]];
 	}
     
 	/* Now we worry about padding. */
@@ -151,14 +110,15 @@ g_string_append_base64(
 		output[1] = ((input[0] & 0x03) << 4) + (input[1] >> 4);
 		output[2] = ((input[1] & 0x0f) << 2) + (input[2] >> 6);
 
-		g_string_append_c(string, Base64[output[0]]);
-		g_string_append_c(string, Base64[output[1]]);
+		*ptr++ = Base64[output[0]];
+		*ptr++ = Base64[output[1]];
 		if (srclength == 1)
-			g_string_append_c(string, Pad64);
+			*ptr++ = Pad64;
 		else
-			g_string_append_c(string, Base64[output[2]]);
-		g_string_append_c(string, Pad64);
+			*ptr++ = Base64[output[2]];
+		*ptr++ = Pad64;
 	}
+	assert(ptr == string->str + string->len);
 }
 
 int
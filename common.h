@@ -22,6 +22,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <glib.h>
+#include <limits.h>
 /* fixme: */
 #define LDAP_DEPRECATED 1
 #include <ldap.h>
@@ -31,6 +32,8 @@
 #include <string.h>
 #include <strings.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/select.h>
 #include <sys/stat.h>
 #include <sys/termios.h>
 #include <sys/time.h>
@@ -47,6 +50,10 @@
 typedef struct tschema {
 	GHashTable *classes;
 	GHashTable *types;
+	GHashTable *entroids;
+	GHashTable *index;
+	int ntypes;
+	GHashTable *classinfo;
 } tschema;
 
 typedef struct tentroid {
@@ -54,6 +61,7 @@ typedef struct tentroid {
 	GPtrArray *classes;
 	GPtrArray *must;
 	GPtrArray *may;
+	guint32 *bits;
 	LDAPObjectClass *structural;
 	GString *comment;
 	GString *error;
@@ -69,6 +77,8 @@ typedef struct tentroid {
 void do_syserr(char *file, int line);
 void yourfault(char *str);
 void ldaperr(LDAP *ld, char *str);
+void quiet_complaints(int quiet);
+void complain(FILE *s, char *fmt, ...);
 
 /*
  * arguments.c
@@ -112,6 +122,14 @@ typedef struct cmdline {
 	int ldapmodify_add;
 	int managedsait;
 	char *sortkeys;
+	int pagesize;
+	int parallel;
+	char *partition;
+	int window;
+	int transaction;
+	int max_rate;
+	char *resume;
+	int coalesce;
 	int starttls;
 	int tls;
 	int deref;
@@ -144,6 +162,8 @@ void usage(int fd, int rc);
 typedef struct named_array {
 	char *name;
 	GPtrArray *array;
+	GHashTable *index;		/* see data.c */
+	int indexed;
 } named_array;
 
 typedef struct tentry {
@@ -160,6 +180,7 @@ typedef struct tattribute {
 
 tentry *entry_new(char *dn);
 void entry_free(tentry *e);
+tentry *entry_copy(tentry *e);
 int entry_cmp(tentry *e, tentry *f);
 
 tattribute *attribute_new(char *ad);
@@ -170,6 +191,7 @@ int named_array_ptr_cmp(const void *aa, const void *bb);
 
 LDAPMod *attribute2mods(tattribute *attribute);
 LDAPMod **entry2mods(tentry *entry);
+LDAPMod **mods_copy(LDAPMod **mods);
 tattribute *entry_find_attribute(tentry *entry, char *ad, int createp);
 void attribute_append_value(tattribute *attribute, char *data, int n);
 int attribute_find_value(tattribute *attribute, char *data, int n);
@@ -215,6 +237,14 @@ int read_delete(FILE *s, long offset, char **dn);
 int skip_entry(FILE *s, long offset, char **key);
 int read_profile(FILE *s, tentry **entry);
 
+/*
+ * scan.c
+ */
+long scan_until(FILE *s, int delim, char **result);
+void scan_unread(FILE *s, long n);
+char *scan_any(char *ptr, long n, char *set, int nset);
+int scan_folded(FILE *s, GString *data, int crlf);
+
 /*
  * diff.c
  */
@@ -232,16 +262,73 @@ typedef struct thandler {
 	handler_rename0 rename0;
 } thandler;
 
+/*
+ * Hash of the LENGTH bytes following OFFSET in the clean file, i.e. of
+ * an entry as written by search() up to and including the newline
+ * starting the next entry.  The last entry has no such newline, so its
+ * LENGTH bytes end at the end of the file instead.
+ */
+typedef struct tdigest {
+	long offset;
+	long length;
+	guint64 hash;
+} tdigest;
+
+/*
+ * Memory-mapped contents of the files being compared, or 0.
+ */
+typedef struct tmapped {
+	char *clean;
+	long cleanlen;
+	char *data;
+	long datalen;
+} tmapped;
+
+void map_streams(tmapped *maps, FILE *clean, FILE **data);
+void unmap_streams(tmapped *maps);
 int compare_streams(
 	tparser *parser,
 	thandler *handler,
 	void *userdata,
 	GArray *offsets,
+	GArray *digests,
 	FILE *clean,
 	FILE *data,
+	tmapped *maps,
 	long *error_position,
 	long *syntax_error_position);
 
+/*
+ * The handler calls made by one compare_streams pass, for replay.
+ */
+typedef struct tchangeset {
+	GPtrArray *changes;
+} tchangeset;
+
+tchangeset *changeset_new(void);
+void changeset_free(tchangeset *cs);
+int changeset_record(
+	tchangeset *cs,
+	tparser *parser,
+	GArray *offsets,
+	GArray *digests,
+	FILE *clean,
+	FILE *data,
+	tmapped *maps,
+	long *error_position,
+	long *syntax_error_position);
+int changeset_replay(
+	tchangeset *cs,
+	tparser *parser,
+	thandler *handler,
+	void *userdata,
+	GArray *offsets,
+	GArray *digests,
+	FILE *clean,
+	FILE *data,
+	tmapped *maps,
+	long *error_position);
+
 enum frob_rdn_mode {
 	FROB_RDN_CHECK, FROB_RDN_REMOVE, FROB_RDN_ADD, FROB_RDN_CHECK_NONE
 };
@@ -263,6 +350,8 @@ typedef struct dialog {
 
 int carray_cmp(GArray *a, GArray *b);
 int carray_ptr_cmp(const void *aa, const void *bb);
+guint carray_hash(gconstpointer p);
+gboolean carray_equal(gconstpointer p, gconstpointer q);
 void cp(char *src, char *dst, off_t skip, int append);
 void fcopy(FILE *src, FILE *dst);
 char choose(char *prompt, char *charbag, char *help);
@@ -281,6 +370,8 @@ void *xalloc(size_t size);
 char *xdup(char *str);
 int adjoin_str(GPtrArray *, char *);
 int adjoin_ptr(GPtrArray *, void *);
+#define FNV_BASIS 14695981039346656037ULL
+guint64 fnv_hash(guint64 h, char *ptr, long n);
 void init_dialog(tdialog *, enum dialog_mode, char *, char *);
 void dialog(char *header, tdialog *, int, int);
 
@@ -294,6 +385,7 @@ tschema *schema_new(LDAP *ld);
 void schema_free(tschema *schema);
 LDAPObjectClass *schema_get_objectclass(tschema *, char *);
 LDAPAttributeType *schema_get_attributetype(tschema *, char *);
+int schema_substr_p(tschema *, char *);
 
 tentroid *entroid_new(tschema *);
 void entroid_reset(tentroid *);
@@ -302,7 +394,9 @@ LDAPObjectClass *entroid_get_objectclass(tentroid *, char *);
 LDAPAttributeType *entroid_get_attributetype(tentroid *, char *);
 LDAPObjectClass *entroid_request_class(tentroid *, char *);
 int entroid_remove_ad(tentroid *, char *);
+int entroid_seen(tentroid *, LDAPAttributeType *);
 int compute_entroid(tentroid *);
+int entroid_set_classes(tentroid *, char **, int);
 
 /*
  * print.c
@@ -312,20 +406,37 @@ typedef enum t_print_binary_mode {
 } t_print_binary_mode;
 extern t_print_binary_mode print_binary_mode;
 
+typedef struct twriter {
+	FILE *s;
+	GString *buf;
+	long pos;			/* stream position of buf->str[0] */
+	int hashing;			/* see writer_digest() */
+	long hashed;			/* stream position hashed up to */
+	guint64 hash;
+} twriter;
+
+twriter *writer_new(FILE *s);
+long writer_tell(twriter *w);
+void writer_flush(twriter *w);
+void writer_start_digests(twriter *w, long start);
+guint64 writer_digest(twriter *w, long end);
+void writer_commit(twriter *w);
+void writer_free(twriter *w);
+
 void print_ldapvi_entry(FILE *s, tentry *entry, char *key, tentroid *);
 void print_ldapvi_modify(FILE *s, char *dn, LDAPMod **mods);
 void print_ldapvi_rename(FILE *s, char *olddn, char *newdn, int deleteoldrdn);
 void print_ldapvi_add(FILE *s, char *dn, LDAPMod **mods);
 void print_ldapvi_delete(FILE *s, char *dn);
 void print_ldapvi_modrdn(FILE *s, char *olddn, char *newrdn, int deleteoldrdn);
-void print_ldapvi_message(FILE *, LDAP *, LDAPMessage *, int key, tentroid *);
+void print_ldapvi_message(twriter *, LDAP *, LDAPMessage *, int, tentroid *);
 void print_ldif_entry(FILE *s, tentry *entry, char *key, tentroid *);
 void print_ldif_modify(FILE *s, char *dn, LDAPMod **mods);
 void print_ldif_rename(FILE *s, char *olddn, char *newdn, int deleteoldrdn);
 void print_ldif_add(FILE *s, char *dn, LDAPMod **mods);
 void print_ldif_delete(FILE *s, char *dn);
 void print_ldif_modrdn(FILE *s, char *olddn, char *newrdn, int deleteoldrdn);
-void print_ldif_message(FILE *, LDAP *, LDAPMessage *, int key, tentroid *);
+void print_ldif_message(twriter *, LDAP *, LDAPMessage *, int, tentroid *);
 
 /*
  * search.c
@@ -333,8 +444,9 @@ void print_ldif_message(FILE *, LDAP *, LDAPMessage *, int key, tentroid *);
 void discover_naming_contexts(LDAP *ld, GPtrArray *basedns);
 GArray *search(
 	FILE *s, LDAP *ld, cmdline *cmdline, LDAPControl **ctrls, int notty,
-	int ldif);
+	int ldif, GArray *digests);
 LDAPMessage *get_entry(LDAP *ld, char *dn, LDAPMessage **result);
+LDAPControl **controls_with(LDAPControl **ctrls, LDAPControl *control);
 
 /*
  * port.c
@@ -348,7 +460,6 @@ int g_string_append_smd5(GString *string, char *key);
 /*
  * base64.c
  */
-void print_base64(unsigned char const *src, size_t srclength, FILE *s);
 void g_string_append_base64(
 	GString *string, unsigned char const *src, size_t srclength);
 int read_base64(char const *src, unsigned char *target, size_t targsize);
@@ -371,3 +482,8 @@ void finish_sasl_redirection(tsasl_defaults *);
 tsasl_defaults *sasl_defaults_new(bind_options *bind_options);
 void sasl_defaults_free(tsasl_defaults *sd);
 int ldapvi_sasl_interact(LDAP *ld, unsigned flags, void *defaults, void *p);
+
+/*
+ * ldapvi.c
+ */
+LDAP *connect_quietly(cmdline *cmdline);
@@ -24,6 +24,8 @@ named_array_new(char *name)
 	named_array *result = xalloc(sizeof(named_array));
 	result->name = name;
 	result->array = g_ptr_array_new();
+	result->index = 0;
+	result->indexed = 0;
 	return result;
 }
 
@@ -32,9 +34,47 @@ named_array_free(named_array *na)
 {
 	free(na->name);
 	g_ptr_array_free(na->array, 1);
+	if (na->index)
+		g_hash_table_destroy(na->index);
 	free(na);
 }
 
+/*
+ * Entries with many attributes and attributes with many values get a
+ * hash table index, built on first lookup.  For entries, it maps
+ * attribute descriptions to attributes; for attributes, values to their
+ * position plus one.
+ *
+ * Code outside of this file may reorder the arrays (but not add or
+ * remove elements).  Hence the index notes the array length it was built
+ * for, and value positions are checked before use.
+ */
+#define INDEX_THRESHOLD 16
+
+static void
+named_array_reindex(named_array *na, GHashFunc hash, GEqualFunc equal,
+		    int positions)
+{
+	int i;
+
+	if (na->index)
+		g_hash_table_destroy(na->index);
+	na->index = g_hash_table_new(hash, equal);
+	for (i = 0; i < na->array->len; i++) {
+		void *key = g_ptr_array_index(na->array, i);
+		if (!positions)
+			key = ((named_array *) key)->name;
+		if (!g_hash_table_lookup(na->index, key))
+			g_hash_table_insert(
+				na->index,
+				key,
+				positions
+				? GINT_TO_POINTER(i + 1)
+				: g_ptr_array_index(na->array, i));
+	}
+	na->indexed = na->array->len;
+}
+
 static int
 named_array_cmp(named_array *a, named_array *b)
 {
@@ -70,6 +110,27 @@ entry_free(tentry *entry)
 	named_array_free((named_array *) entry);
 }
 
+tentry *
+entry_copy(tentry *entry)
+{
+	GPtrArray *attributes = entry_attributes(entry);
+	tentry *result = entry_new(xdup(entry_dn(entry)));
+	int i, j;
+
+	for (i = 0; i < attributes->len; i++) {
+		tattribute *a = g_ptr_array_index(attributes, i);
+		GPtrArray *values = attribute_values(a);
+		tattribute *b = attribute_new(xdup(attribute_ad(a)));
+
+		for (j = 0; j < values->len; j++) {
+			GArray *av = g_ptr_array_index(values, j);
+			attribute_append_value(b, av->data, av->len);
+		}
+		g_ptr_array_add(entry_attributes(result), b);
+	}
+	return result;
+}
+
 int
 entry_cmp(tentry *e, tentry *f)
 {
@@ -115,9 +176,24 @@ tattribute *
 entry_find_attribute(tentry *entry, char *ad, int createp)
 {
 	GPtrArray *attributes = entry_attributes(entry);
+	named_array *na = &entry->e;
 	tattribute *attribute = 0;
 	int i;
 
+	if (attributes->len >= INDEX_THRESHOLD) {
+		if (!na->index || na->indexed != attributes->len)
+			named_array_reindex(na, g_str_hash, g_str_equal, 0);
+		attribute = g_hash_table_lookup(na->index, ad);
+		if (!attribute && createp) {
+			attribute = attribute_new(xdup(ad));
+			g_ptr_array_add(attributes, attribute);
+			g_hash_table_insert(
+				na->index, attribute_ad(attribute), attribute);
+			na->indexed++;
+		}
+		return attribute;
+	}
+
 	for (i = 0; i < attributes->len; i++) {
 		tattribute *a = g_ptr_array_index(attributes, i);
 		if (!strcmp(attribute_ad(a), ad)) {
@@ -137,8 +213,17 @@ void
 attribute_append_value(tattribute *attribute, char *data, int n)
 {
 	GArray *value = g_array_sized_new(0, 0, 1, n);
+	named_array *na = &attribute->a;
+
 	g_array_append_vals(value, data, n);
-	g_ptr_array_add(attribute_values(attribute), value);
+	g_ptr_array_add(na->array, value);
+	if (na->index && na->indexed == na->array->len - 1) {
+		if (!g_hash_table_lookup(na->index, value))
+			g_hash_table_insert(
+				na->index, value,
+				GINT_TO_POINTER(na->array->len));
+		na->indexed++;
+	}
 }
 
 int
@@ -146,6 +231,26 @@ attribute_find_value(tattribute *attribute, char *data, int n)
 {
 	int i;
 	GPtrArray *values = attribute_values(attribute);
+	named_array *na = &attribute->a;
+
+	if (values->len >= INDEX_THRESHOLD) {
+		GArray key;
+		key.data = data;
+		key.len = n;
+		if (!na->index || na->indexed != values->len)
+			named_array_reindex(
+				na, carray_hash, carray_equal, 1);
+		i = GPOINTER_TO_INT(g_hash_table_lookup(na->index, &key)) - 1;
+		if (i >= 0 && carray_cmp(values->pdata[i], &key)) {
+			/* values have been reordered */
+			named_array_reindex(
+				na, carray_hash, carray_equal, 1);
+			i = GPOINTER_TO_INT(
+				g_hash_table_lookup(na->index, &key)) - 1;
+		}
+		return i;
+	}
+
 	for (i = 0; i < values->len; i++) {
 		GArray *value = values->pdata[i];
 		if (value->len == n && !memcmp(value->data, data, n))
@@ -160,6 +265,11 @@ attribute_remove_value(tattribute *a, char *data, int n)
 	int i = attribute_find_value(a, data, n);
 	if (i == -1) return i;
 	g_array_free(g_ptr_array_remove_index_fast(attribute_values(a), i), 1);
+	if (a->a.index) {
+		/* rebuilt when needed */
+		g_hash_table_destroy(a->a.index);
+		a->a.index = 0;
+	}
 	return 0;
 }
 
@@ -228,6 +338,57 @@ attribute2mods(tattribute *attribute)
 	return m;
 }
 
+/*
+ * Return a deep copy of MODS, to be freed using ldap_mods_free(mods, 1).
+ */
+LDAPMod **
+mods_copy(LDAPMod **mods)
+{
+	LDAPMod **result;
+	int i, j;
+
+	for (i = 0; mods[i]; i++)
+		;
+	result = xalloc((i + 1) * sizeof(LDAPMod *));
+	for (i = 0; mods[i]; i++) {
+		LDAPMod *m = mods[i];
+		LDAPMod *n = xalloc(sizeof(LDAPMod));
+
+		n->mod_op = m->mod_op;
+		n->mod_type = xdup(m->mod_type);
+		if (m->mod_op & LDAP_MOD_BVALUES) {
+			struct berval **values = m->mod_bvalues;
+			n->mod_bvalues = 0;
+			if (values) {
+				for (j = 0; values[j]; j++)
+					;
+				n->mod_bvalues = xalloc(
+					(j + 1) * sizeof(struct berval *));
+				for (j = 0; values[j]; j++)
+					n->mod_bvalues[j] = dup2berval(
+						values[j]->bv_val,
+						values[j]->bv_len);
+				n->mod_bvalues[j] = 0;
+			}
+		} else {
+			char **values = m->mod_values;
+			n->mod_values = 0;
+			if (values) {
+				for (j = 0; values[j]; j++)
+					;
+				n->mod_values = xalloc(
+					(j + 1) * sizeof(char *));
+				for (j = 0; values[j]; j++)
+					n->mod_values[j] = xdup(values[j]);
+				n->mod_values[j] = 0;
+			}
+		}
+		result[i] = n;
+	}
+	result[i] = 0;
+	return result;
+}
+
 LDAPMod **
 entry2mods(tentry *entry)
 {
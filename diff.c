@@ -66,12 +66,112 @@ ordered_array_equal(GPtrArray *a, GPtrArray *b,
 	return 1;
 }
 
+static LDAPMod *
+values2mod(int op, char *ad, GPtrArray *values, int start, int end)
+{
+	LDAPMod *m = xalloc(sizeof(LDAPMod));
+	int i;
+
+	m->mod_op = op | LDAP_MOD_BVALUES;
+	m->mod_type = xdup(ad);
+	m->mod_bvalues = xalloc((1 + end - start) * sizeof(struct berval *));
+	for (i = start; i < end; i++)
+		m->mod_bvalues[i - start]
+			= string2berval(g_ptr_array_index(values, i));
+	m->mod_bvalues[end - start] = 0;
+	return m;
+}
+
+/*
+ * Does VALUE start with an ordering index as in X-ORDERED 'VALUES'
+ * attributes, e.g. {0}?
+ */
+static int
+ordered_value_p(GArray *value)
+{
+	int i;
+
+	if (value->len < 3 || value->data[0] != '{')
+		return 0;
+	for (i = 1; i < value->len && isdigit((unsigned char) value->data[i]);
+	     i++)
+		;
+	return i > 1 && i < value->len && value->data[i] == '}';
+}
+
+/*
+ * Try to express the change from CLEAN to NEW as deletions of some old
+ * values followed by additions of some new values, keeping the order of
+ * values as edited:  The values kept must still come first and in their
+ * old order, followed by those added.  Return 0 on success, -1 if only a
+ * replace will do (or is cheaper).  Values with ordering indices are
+ * always replaced.
+ */
+static int
+compare_values(tattribute *clean, tattribute *new, GPtrArray *mods)
+{
+	GPtrArray *a = attribute_values(clean);
+	GPtrArray *b = attribute_values(new);
+	GHashTable *counts = g_hash_table_new(carray_hash, carray_equal);
+	GPtrArray *deleted = g_ptr_array_new();
+	int nkept = 0;
+	int rc = -1;
+	int i;
+
+	for (i = 0; i < b->len; i++) {
+		void *value = g_ptr_array_index(b, i);
+		int n = GPOINTER_TO_INT(g_hash_table_lookup(counts, value));
+		if (ordered_value_p(value))
+			/* the server numbers these, leave them alone */
+			goto cleanup;
+		g_hash_table_insert(counts, value, GINT_TO_POINTER(n + 1));
+	}
+	for (i = 0; i < a->len; i++) {
+		GArray *value = g_ptr_array_index(a, i);
+		int n = GPOINTER_TO_INT(g_hash_table_lookup(counts, value));
+
+		if (n) {
+			/* kept, at position nkept in the new list? */
+			if (carray_cmp(value, g_ptr_array_index(b, nkept)))
+				goto cleanup;
+			g_hash_table_insert(
+				counts, value, GINT_TO_POINTER(n - 1));
+			nkept++;
+		} else
+			g_ptr_array_add(deleted, value);
+	}
+
+	/* order change only, or replacing is cheaper */
+	if (nkept == a->len && nkept == b->len)
+		goto cleanup;
+	if (deleted->len + (b->len - nkept) >= b->len)
+		goto cleanup;
+
+	if (deleted->len)
+		g_ptr_array_add(
+			mods,
+			values2mod(LDAP_MOD_DELETE, attribute_ad(clean),
+				   deleted, 0, deleted->len));
+	if (nkept < b->len)
+		g_ptr_array_add(
+			mods,
+			values2mod(LDAP_MOD_ADD, attribute_ad(new),
+				   b, nkept, b->len));
+	rc = 0;
+
+cleanup:
+	g_hash_table_destroy(counts);
+	g_ptr_array_free(deleted, 1);
+	return rc;
+}
+
 static void
 compare_attributes(tattribute *clean, tattribute *new, GPtrArray *mods)
 {
 	if (!ordered_array_equal(attribute_values(clean),
 				 attribute_values(new),
-				 carray_ptr_cmp))
+				 carray_ptr_cmp)
+	    && compare_values(clean, new, mods) == -1)
 	{
 		LDAPMod *m = attribute2mods(new);
 		m->mod_op |= LDAP_MOD_REPLACE;
@@ -171,6 +271,114 @@ cleanup:
 	return rc;
 }
 
+/*
+ * Like fastcmp, but compare the memory-mapped files in MAPS directly.
+ */
+static int
+mapped_fastcmp(tmapped *maps, long p, long q, long n)
+{
+	if (p + n > maps->cleanlen || q + n > maps->datalen)
+		return 1;
+	return memcmp(maps->clean + p, maps->data + q, n) != 0;
+}
+
+static char *
+map_stream(FILE *s, long *len)
+{
+	struct stat st;
+	char *result;
+
+	if (fstat(fileno(s), &st) == -1 || !S_ISREG(st.st_mode)
+	    || st.st_size == 0 || st.st_size > LONG_MAX)
+		return 0;
+	result = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fileno(s), 0);
+	if (result == MAP_FAILED)
+		return 0;
+	*len = st.st_size;
+	return result;
+}
+
+/*
+ * Map the files open as CLEAN and *DATA into memory, so that
+ * compare_streams can compare unchanged entries without any copying.
+ * Where possible, *DATA is replaced with a stream reading from the
+ * mapping.  Files that cannot be mapped are compared using stdio as
+ * before.
+ */
+void
+map_streams(tmapped *maps, FILE *clean, FILE **data)
+{
+	maps->clean = map_stream(clean, &maps->cleanlen);
+	maps->data = map_stream(*data, &maps->datalen);
+#ifdef HAVE_FMEMOPEN
+	if (maps->data) {
+		FILE *s = fmemopen(maps->data, maps->datalen, "r");
+		if (s) {
+			if (fclose(*data) == EOF) syserr();
+			*data = s;
+		}
+	}
+#endif
+}
+
+/*
+ * Release the mappings made by map_streams, after closing the streams.
+ */
+void
+unmap_streams(tmapped *maps)
+{
+	if (maps->clean && munmap(maps->clean, maps->cleanlen) == -1)
+		syserr();
+	if (maps->data && munmap(maps->data, maps->datalen) == -1)
+		syserr();
+}
+
+/*
+ * Return 0 if the data file region described by D, starting at DATAPOS,
+ * hashes to D->hash, else 1.
+ */
+static int
+digestcmp(FILE *data, tmapped *maps, long datapos, tdigest *d)
+{
+	guint64 h = FNV_BASIS;
+	char buf[4096];
+	long n = d->length;
+
+	if (maps && maps->data) {
+		if (datapos + n > maps->datalen)
+			return 1;
+		h = fnv_hash(h, maps->data + datapos, n);
+	} else {
+		if (fseek(data, datapos, SEEK_SET) == -1) syserr();
+		while (n > 0) {
+			long m = n < sizeof(buf) ? n : sizeof(buf);
+			if (fread(buf, 1, m, data) != m) {
+				if (ferror(data)) syserr();
+				return 1;
+			}
+			h = fnv_hash(h, buf, m);
+			n -= m;
+		}
+	}
+	return h != d->hash;
+}
+
+/*
+ * Return true if the data file has a newline or its end at POS.
+ */
+static int
+digest_end_p(FILE *data, tmapped *maps, long pos)
+{
+	int c;
+
+	if (maps && maps->data)
+		return pos == maps->datalen
+			|| (pos < maps->datalen && maps->data[pos] == '\n');
+	if (fseek(data, pos, SEEK_SET) == -1) syserr();
+	if ( (c = getc(data)) == EOF && ferror(data)) syserr();
+	return c == EOF || c == '\n';
+}
+
 /*
  * Do something with ENTRY and attribute AD, value DATA.
  *
@@ -211,27 +419,6 @@ frob_ava(tentry *entry, int mode, char *ad, char *data, int n)
 	return 0;
 }
 
-#if defined(LIBLDAP21)
-#warning compiling for libldap <= 2.1, running with >= 2.2 will result in segfault
-#define safe_str2dn ldap_str2dn
-#elif defined(LIBLDAP22)
-/*
- * the following is exactly equivalent to ldap_str2dn in libldap >= 2.2,
- * but will fail linking on 2.1.  This way we avoid calling the old 2.1
- * version of ldap_str2dn (leading to a segfault when accessing the result).
- */
-static void
-safe_str2dn(char *str, LDAPDN *out, int flags)
-{
-        struct berval bv;
-        bv.bv_val = str;
-        bv.bv_len = strlen(str);
-        ldap_bv2dn_x(&bv, out, flags);
-}
-#else
-#error oops
-#endif
-
 /*
  * Call frob_ava for every ava in DN's (first) RDN.
  * DN must be valid.
@@ -241,22 +428,13 @@ safe_str2dn(char *str, LDAPDN *out, int flags)
 int
 frob_rdn(tentry *entry, char *dn, int mode)
 {
-#ifdef LIBLDAP21
-	LDAPDN *olddn;
-#else
 	LDAPDN olddn;
-#endif
 	LDAPRDN rdn;
 	int i;
 	int rc = 0;
 
-	safe_str2dn(dn, &olddn, LDAP_DN_FORMAT_LDAPV3);
-
-#ifdef LIBLDAP21
-	rdn = (**olddn)[0];
-#else
+	ldap_str2dn(dn, &olddn, LDAP_DN_FORMAT_LDAPV3);
 	rdn = olddn[0];
-#endif
 	for (i = 0; rdn[i]; i++) {
 		LDAPAVA *ava = rdn[i];
 		char *ad = ava->la_attr.bv_val; /* XXX */
@@ -284,19 +462,19 @@ int
 validate_rename(tentry *clean, tentry *data, int *deleteoldrdn)
 {
 	if (!*entry_dn(clean)) {
-		puts("Error: Cannot rename ROOT_DSE.");
+		complain(stdout, "Error: Cannot rename ROOT_DSE.\n");
 		return -1;
 	}
 	if (!*entry_dn(data)) {
-		puts("Error: Cannot replace ROOT_DSE.");
+		complain(stdout, "Error: Cannot replace ROOT_DSE.\n");
 		return -1;
 	}
 	if (frob_rdn(clean, entry_dn(clean), FROB_RDN_CHECK) == -1) {
-		puts("Error: Old RDN not found in entry.");
+		complain(stdout, "Error: Old RDN not found in entry.\n");
 		return -1;
 	}
 	if (frob_rdn(data, entry_dn(data), FROB_RDN_CHECK) == -1) {
-		puts("Error: New RDN not found in entry.");
+		complain(stdout, "Error: New RDN not found in entry.\n");
 		return -1;
 	}
 	if (frob_rdn(data, entry_dn(clean), FROB_RDN_CHECK) != -1)
@@ -304,7 +482,7 @@ validate_rename(tentry *clean, tentry *data, int *deleteoldrdn)
 	else if (frob_rdn(data, entry_dn(clean), FROB_RDN_CHECK_NONE) != -1)
 		*deleteoldrdn = 1;
 	else {
-		puts("Error: Incomplete RDN change.");
+		complain(stdout, "Error: Incomplete RDN change.\n");
 		return -1;
 	}
 	return 0;
@@ -410,12 +588,27 @@ process_immediate(tparser *p, thandler *handler, void *userdata, FILE *data,
 			return -2;
 		}
 	} else {
-		fprintf(stderr, "Error: Invalid key: `%s'.\n", key);
+		complain(stderr, "Error: Invalid key: `%s'.\n", key);
 		return -1;
 	}
 	return 0;
 }
 
+/*
+ * Entries already processed are flagged by inverting their offsets, or,
+ * when comparing in parallel, in a bitset SEEN private to the thread.
+ */
+#define SEEN_P(seen, n) ((seen)[(n) / 32] & (1U << ((n) % 32)))
+
+static void
+mark_seen(GArray *offsets, guint32 *seen, int n)
+{
+	if (seen)
+		seen[n / 32] |= 1U << (n % 32);
+	else
+		long_array_invert(offsets, n);
+}
+
 /*
  * read the next entry from `data', its clean copy from `clean', process
  * them as described for compare_streams, and return
@@ -426,7 +619,8 @@ process_immediate(tparser *p, thandler *handler, void *userdata, FILE *data,
 static int
 process_next_entry(
 	tparser *p, thandler *handler, void *userdata, GArray *offsets,
-	FILE *clean, FILE *data, char *key, long datapos)
+	GArray *digests, FILE *clean, FILE *data, tmapped *maps,
+	guint32 *seen, char *key, long datapos)
 {
 	tentry *entry = 0;
 	tentry *cleanentry = 0;
@@ -443,25 +637,50 @@ process_next_entry(
 		return process_immediate(
 			p, handler, userdata, data, datapos, key);
 	if (n < 0 || n >= offsets->len) {
-		fprintf(stderr, "Error: Invalid key: `%s'.\n", key);
+		complain(stderr, "Error: Invalid key: `%s'.\n", key);
 		goto cleanup;
 	}
 	pos = g_array_index(offsets, long, n);
-	if (pos < 0) {
-		fprintf(stderr, "Error: Duplicate entry %d.\n", n);
+	if (pos < 0 || (seen && SEEN_P(seen, n))) {
+		complain(stderr, "Error: Duplicate entry %d.\n", n);
 		goto cleanup;
 	}
 
+	/* unchanged according to the digest recorded by search()?  The
+	 * clean file is append-only, so the digest is valid as long as the
+	 * offsets still match.  The last entry's digest does not include
+	 * the newline ending it, so check for that separately. */
+	if (digests && n < digests->len) {
+		tdigest *d = &g_array_index(digests, tdigest, n);
+		int last = n + 1 == offsets->len;
+		if (d->offset == pos
+		    && (last
+			|| d->offset + d->length
+			   == g_array_index(offsets, long, n + 1))
+		    && !digestcmp(data, maps, datapos, d)
+		    && (!last || digest_end_p(data, maps, datapos + d->length)))
+		{
+			datapos += last ? d->length : d->length - 1;
+			mark_seen(offsets, seen, n);
+			if (fseek(data, datapos, SEEK_SET) == -1)
+				syserr();
+			return 0;
+		}
+	}
+
 	/* find precise position */
 	if (p->entry(clean, pos, 0, 0, &pos) == -1) abort();
 	/* fast comparison */
 	if (n + 1 < offsets->len) {
 		long next = g_array_index(offsets, long, n + 1);
+		long len = next - pos + 1;
 		if (next >= 0
-		    && !fastcmp(clean, data, pos, datapos, next-pos+1))
+		    && !(maps && maps->clean && maps->data
+			 ? mapped_fastcmp(maps, pos, datapos, len)
+			 : fastcmp(clean, data, pos, datapos, len)))
 		{
 			datapos += next - pos;
-			long_array_invert(offsets, n);
+			mark_seen(offsets, seen, n);
 			if (fseek(data, datapos, SEEK_SET) == -1)
 				syserr();
 			return 0;
@@ -507,7 +726,7 @@ process_next_entry(
 	}
 
 	/* mark as seen */
-	long_array_invert(offsets, n);
+	mark_seen(offsets, seen, n);
 
 	entry_free(entry);
 	entry = 0;
@@ -518,7 +737,7 @@ process_next_entry(
 cleanup:
 	if (entry) {
 		if (*entry_dn(entry))
-			fprintf(stderr, "Error at: %s\n", entry_dn(entry));
+			complain(stderr, "Error at: %s\n", entry_dn(entry));
 		entry_free(entry);
 	}
 	if (cleanentry) entry_free(cleanentry);
@@ -526,11 +745,11 @@ cleanup:
 }
 
 static int
-nonleaf_action(tentry *entry, GArray *offsets, int n)
+nonleaf_action(char *dn, GArray *offsets, int n)
 {
 	int i;
 
-	printf("Error: Cannot delete non-leaf entry: %s\n", entry_dn(entry));
+	printf("Error: Cannot delete non-leaf entry: %s\n", dn);
 
 	for (i = n + 1; i < offsets->len; i++) {
 		if (g_array_index(offsets, long, n) >= 0)
@@ -563,6 +782,67 @@ more_deletions:
 	return 0;
 }
 
+typedef struct tdeletion {
+	int n;
+	int depth;
+	char *dn;
+} tdeletion;
+
+static int
+deletion_cmp(const void *aa, const void *bb)
+{
+	const tdeletion *a = aa;
+	const tdeletion *b = bb;
+	if (a->depth != b->depth)
+		return b->depth - a->depth;
+	return a->n - b->n;
+}
+
+/*
+ * Return the entries to be deleted, i.e. those with non-negative offsets,
+ * as an array of tdeletion, ordered so that children come before their
+ * parents:  deepest DNs first, otherwise in file order.
+ *
+ * Each entry is parsed only here; its DN is kept for the deletion itself.
+ */
+static GArray *
+deletion_order(tparser *p, GArray *offsets, FILE *clean)
+{
+	GArray *result = g_array_new(0, 0, sizeof(tdeletion));
+	tentry *cleanentry;
+	tdeletion d;
+	long pos;
+	char **rdns;
+
+	for (d.n = 0; d.n < offsets->len; d.n++) {
+		if ( (pos = g_array_index(offsets, long, d.n)) < 0)
+			continue;
+		if (p->entry(clean, pos, 0, &cleanentry, 0) == -1)
+			abort();
+		d.dn = xdup(entry_dn(cleanentry));
+		d.depth = 0;
+		if ( (rdns = ldap_explode_dn(d.dn, 0))) {
+			while (rdns[d.depth])
+				d.depth++;
+			ldap_value_free(rdns);
+		}
+		entry_free(cleanentry);
+		g_array_append_val(result, d);
+	}
+	qsort(result->data, result->len, sizeof(tdeletion), deletion_cmp);
+	return result;
+}
+
+static void
+deletion_order_free(GArray *order)
+{
+	int i;
+
+	for (i = 0; i < order->len; i++)
+		free(g_array_index(order, tdeletion, i).dn);
+	g_array_free(order, 1);
+}
+
 /*
  * process deletions as described for compare_streams.
  * return 0 on success, -2 else.
@@ -574,9 +854,9 @@ process_deletions(tparser *p,
 		  GArray *offsets,
 		  FILE *clean)
 {
-	tentry *cleanentry = 0;
-	long pos;
-	int n;
+	GArray *order = deletion_order(p, offsets, clean);
+	tdeletion *d;
+	int i;
 	int ignore_nonleaf = 0;
 	int n_leaf;
 	int n_nonleaf;
@@ -588,27 +868,24 @@ process_deletions(tparser *p,
 			       n_nonleaf == 1 ? "" : "s");
 		n_leaf = 0;
 		n_nonleaf = 0;
-		for (n = 0; n < offsets->len; n++) {
-			if ( (pos = g_array_index(offsets, long, n)) < 0)
+		for (i = 0; i < order->len; i++) {
+			d = &g_array_index(order, tdeletion, i);
+			if (g_array_index(offsets, long, d->n) < 0)
 				continue;
-			if (p->entry(clean, pos, 0, &cleanentry, 0) == -1)
-				abort();
-			switch (handler->delete(
-					n, entry_dn(cleanentry), userdata))
-			{
+			switch (handler->delete(d->n, d->dn, userdata)) {
 			case -1:
-				entry_free(cleanentry);
+				deletion_order_free(order);
 				return -2;
 			case -2:
 				if (ignore_nonleaf) {
 					printf("Skipping non-leaf entry: %s\n",
-					       entry_dn(cleanentry));
+					       d->dn);
 					n_nonleaf++;
 					break;
 				}
-				switch (nonleaf_action(cleanentry,offsets,n)) {
+				switch (nonleaf_action(d->dn, offsets, d->n)) {
 				case 0:
-					entry_free(cleanentry);
+					deletion_order_free(order);
 					return -2;
 				case 2:
 					ignore_nonleaf = 1;
@@ -619,12 +896,12 @@ process_deletions(tparser *p,
 				break;
 			default:
 				n_leaf++;
-				long_array_invert(offsets, n);
+				long_array_invert(offsets, d->n);
 			}
-			entry_free(cleanentry);
 		}
 	} while (ignore_nonleaf && n_nonleaf > 0 && n_leaf > 0);
 
+	deletion_order_free(order);
 	return n_nonleaf ? -2 : 0;
 }
 
@@ -654,6 +931,7 @@ process_deletions(tparser *p,
  *
  * For each entry present in CLEAN but not DATA, call
  *   handler->delete(dn, USERDATA)
+ * Deletions are ordered children-first, deepest DNs before their parents.
  * (This step can be repeated in the case of non-leaf entries.)
  *
  * For each entry present in both files, handler can be called two times.
@@ -675,6 +953,11 @@ process_deletions(tparser *p,
  *
  * Return 0 on success, -1 on parse error, -2 on handler failure.
  *
+ * DIGESTS, if non-null, holds tdigests of the entries in CLEAN, allowing
+ * unchanged entries to be recognized without reading CLEAN at all.
+ *
+ * MAPS, if non-null, holds the files mapped by map_streams.
+ *
  * If an error occured, *error_position is the offset in DATA after
  * which the erroneous entry can be found.
  */
@@ -683,8 +966,10 @@ compare_streams(tparser *p,
 		thandler *handler,
 		void *userdata,
 		GArray *offsets,
+		GArray *digests,
 		FILE *clean,
 		FILE *data,
+		tmapped *maps,
 		long *error_position,
 		long *syntax_error_position)
 {
@@ -703,8 +988,8 @@ compare_streams(tparser *p,
 
 		/* and do something with it */
 		if ( (rc = process_next_entry(
-			      p, handler, userdata, offsets, clean, data,
-			      key, datapos)))
+			      p, handler, userdata, offsets, digests, clean,
+			      data, maps, 0, key, datapos)))
 			goto cleanup;
 	}
 	if ( (*error_position = ftell(data)) == -1) syserr();
@@ -726,3 +1011,500 @@ cleanup:
 			long_array_invert(offsets, n);
 	return rc;
 }
+
+
+/*
+ * Change sets.
+ *
+ * Comparing the clean and data files is expensive for large searches, and
+ * a typical session compares the same files several times (statistics,
+ * view, commit).  changeset_record() runs compare_streams once, saving
+ * all handler calls, so that changeset_replay() can pass them on to other
+ * handlers without parsing anything.
+ */
+enum change_op {
+	CHANGE_MODIFY, CHANGE_RENAME, CHANGE_ADD, CHANGE_DELETE, CHANGE_RENAME0
+};
+
+typedef struct tchange {
+	enum change_op op;
+	int key;
+	char *dn1;
+	char *dn2;
+	LDAPMod **mods;
+	tentry *entry;
+	int deleteoldrdn;
+} tchange;
+
+tchangeset *
+changeset_new(void)
+{
+	tchangeset *cs = xalloc(sizeof(tchangeset));
+	cs->changes = g_ptr_array_new();
+	return cs;
+}
+
+void
+changeset_free(tchangeset *cs)
+{
+	int i;
+
+	for (i = 0; i < cs->changes->len; i++) {
+		tchange *c = g_ptr_array_index(cs->changes, i);
+		if (c->dn1) free(c->dn1);
+		if (c->dn2) free(c->dn2);
+		if (c->mods) ldap_mods_free(c->mods, 1);
+		if (c->entry) entry_free(c->entry);
+		free(c);
+	}
+	g_ptr_array_free(cs->changes, 1);
+	free(cs);
+}
+
+static tchange *
+changeset_add(tchangeset *cs, enum change_op op, int key, char *dn1)
+{
+	tchange *c = xalloc(sizeof(tchange));
+	c->op = op;
+	c->key = key;
+	c->dn1 = dn1 ? xdup(dn1) : 0;
+	c->dn2 = 0;
+	c->mods = 0;
+	c->entry = 0;
+	c->deleteoldrdn = 0;
+	g_ptr_array_add(cs->changes, c);
+	return c;
+}
+
+static int
+record_change(int key, char *labeldn, char *dn, LDAPMod **mods, void *cs)
+{
+	tchange *c = changeset_add(cs, CHANGE_MODIFY, key, labeldn);
+	c->dn2 = xdup(dn);
+	c->mods = mods_copy(mods);
+	return 0;
+}
+
+static int
+record_rename(int key, char *olddn, tentry *modified, void *cs)
+{
+	tchange *c = changeset_add(cs, CHANGE_RENAME, key, olddn);
+	c->entry = entry_copy(modified);
+	return 0;
+}
+
+static int
+record_add(int key, char *dn, LDAPMod **mods, void *cs)
+{
+	tchange *c = changeset_add(cs, CHANGE_ADD, key, dn);
+	c->mods = mods_copy(mods);
+	return 0;
+}
+
+static int
+record_delete(int key, char *dn, void *cs)
+{
+	changeset_add(cs, CHANGE_DELETE, key, dn);
+	return 0;
+}
+
+static int
+record_rename0(int key, char *dn1, char *dn2, int deleteoldrdn, void *cs)
+{
+	tchange *c = changeset_add(cs, CHANGE_RENAME0, key, dn1);
+	c->dn2 = xdup(dn2);
+	c->deleteoldrdn = deleteoldrdn;
+	return 0;
+}
+
+static thandler record_handler = {
+	record_change,
+	record_rename,
+	record_add,
+	record_delete,
+	record_rename0
+};
+
+#ifdef HAVE_FMEMOPEN
+/*
+ * Parallel comparison.
+ *
+ * The data file is cut into chunks at blank lines, and each chunk is
+ * compared by its own thread, reading both files from their mappings.
+ * Threads do not touch the offsets table; they flag the entries they
+ * have seen in a private bitset.
+ *
+ * A cut might fall inside a record after all, so afterwards we check that
+ * each thread started at the record where its predecessor stopped.  If
+ * that fails, or if any thread found an error or an entry occurs in more
+ * than one chunk, everything is compared again sequentially, so that the
+ * results (and error messages) are exactly those of compare_streams.
+ */
+#define PARALLEL_CHUNK_MIN (4L << 20)
+#define PARALLEL_THREADS_MAX 16
+
+typedef struct tdiff_worker {
+	tparser *p;
+	GArray *offsets;
+	GArray *digests;
+	tmapped *maps;
+	long start;			/* where to start reading */
+	long end;			/* first record not ours starts here */
+	tchangeset *cs;
+	guint32 *seen;
+	GArray *keys;			/* entries seen, in order */
+	long first;			/* position of the first record */
+	long stop;			/* position of the first record not read */
+	int quiet;			/* don't print parse errors */
+	int rc;
+} tdiff_worker;
+
+static gpointer
+diff_worker(gpointer x)
+{
+	tdiff_worker *w = x;
+	FILE *clean = fmemopen(w->maps->clean, w->maps->cleanlen, "r");
+	FILE *data = fmemopen(w->maps->data, w->maps->datalen, "r");
+	char *key = 0;
+	char *ptr;
+	long datapos = w->start;
+	int n;
+
+	if (!clean || !data) syserr();
+	if (fseek(data, w->start, SEEK_SET) == -1) syserr();
+	quiet_complaints(w->quiet);
+	w->first = -1;
+	w->rc = 0;
+	for (;;) {
+		if (w->p->peek(data, -1, &key, &datapos) == -1) {
+			w->rc = -1;
+			break;
+		}
+		if (w->first == -1)
+			w->first = datapos;
+		if (!key || datapos >= w->end)
+			break;
+		n = strtol(key, &ptr, 10);
+		if ( (w->rc = process_next_entry(
+			      w->p, &record_handler, w->cs, w->offsets,
+			      w->digests, clean, data, w->maps, w->seen,
+			      key, datapos)))
+			break;
+		if (!*ptr)
+			g_array_append_val(w->keys, n);
+		free(key);
+		key = 0;
+	}
+	w->stop = datapos;
+	if (key) free(key);
+	if (fclose(clean) == EOF) syserr();
+	if (fclose(data) == EOF) syserr();
+	return 0;
+}
+
+/*
+ * Return the position of the first blank line at or after POS that can
+ * start a chunk, or -1.
+ */
+static long
+find_chunk_start(char *data, long len, long pos)
+{
+	char *ptr = data + pos;
+	char *end = data + len;
+
+	while (ptr < end && (ptr = memchr(ptr, '\n', end - ptr))) {
+		if (ptr + 1 < end && ptr[1] == '\n') {
+			/* not a backslash-escaped newline? */
+			char *q = ptr;
+			while (q > data && q[-1] == '\\')
+				q--;
+			if ((ptr - q) % 2 == 0)
+				return ptr + 1 - data;
+		}
+		ptr++;
+	}
+	return -1;
+}
+
+/*
+ * Like changeset_record, using several threads if the files are large.
+ * Return 0 or -1 as changeset_record does, or 1 if the comparison needs
+ * to be done sequentially after all.
+ */
+static int
+changeset_record_parallel(tchangeset *cs,
+			  tparser *p,
+			  GArray *offsets,
+			  GArray *digests,
+			  FILE *clean,
+			  tmapped *maps)
+{
+	tdiff_worker workers[PARALLEL_THREADS_MAX];
+	GThread *threads[PARALLEL_THREADS_MAX];
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	int nwords = (offsets->len + 31) / 32;
+	guint32 *all;
+	int nworkers;
+	int i, j;
+	int rc = 0;
+
+	if (!maps->clean || !maps->data)
+		return 1;
+	nworkers = maps->datalen / PARALLEL_CHUNK_MIN;
+	if (nworkers > ncpu) nworkers = ncpu;
+	if (nworkers > PARALLEL_THREADS_MAX) nworkers = PARALLEL_THREADS_MAX;
+	if (nworkers < 2)
+		return 1;
+
+	/* cut */
+	workers[0].start = 0;
+	for (i = 1, j = 1; j < nworkers; j++) {
+		long pos = find_chunk_start(
+			maps->data, maps->datalen,
+			maps->datalen / nworkers * j);
+		if (pos == -1)
+			break;
+		if (pos > workers[i - 1].start)
+			workers[i++].start = pos;
+	}
+	nworkers = i;
+	if (nworkers < 2)
+		return 1;
+
+	for (i = 0; i < nworkers; i++) {
+		tdiff_worker *w = &workers[i];
+		w->p = p;
+		w->offsets = offsets;
+		w->digests = digests;
+		w->maps = maps;
+		w->end = i + 1 < nworkers ? workers[i + 1].start : LONG_MAX;
+		w->cs = changeset_new();
+		w->seen = xalloc(nwords * sizeof(guint32) + 1);
+		memset(w->seen, 0, nwords * sizeof(guint32));
+		w->keys = g_array_new(0, 0, sizeof(int));
+		/* the threads' parse errors are of no interest, see above */
+		w->quiet = 1;
+		threads[i] = g_thread_new("diff", diff_worker, w);
+	}
+	for (i = 0; i < nworkers; i++)
+		g_thread_join(threads[i]);
+
+	/* check */
+	all = xalloc(nwords * sizeof(guint32) + 1);
+	memset(all, 0, nwords * sizeof(guint32));
+	for (i = 0; i < nworkers && !rc; i++) {
+		tdiff_worker *w = &workers[i];
+		if (w->rc || (i > 0 && w->first != workers[i - 1].stop))
+			rc = 1;
+		for (j = 0; j < w->keys->len && !rc; j++) {
+			int n = g_array_index(w->keys, int, j);
+			if (SEEN_P(all, n))
+				rc = 1;
+			all[n / 32] |= 1U << (n % 32);
+		}
+	}
+	free(all);
+
+	/* merge */
+	for (i = 0; i < nworkers; i++) {
+		tdiff_worker *w = &workers[i];
+		if (!rc) {
+			for (j = 0; j < w->cs->changes->len; j++)
+				g_ptr_array_add(
+					cs->changes,
+					g_ptr_array_index(w->cs->changes, j));
+			g_ptr_array_set_size(w->cs->changes, 0);
+			for (j = 0; j < w->keys->len; j++)
+				long_array_invert(
+					offsets,
+					g_array_index(w->keys, int, j));
+		}
+		changeset_free(w->cs);
+		free(w->seen);
+		g_array_free(w->keys, 1);
+	}
+	if (rc)
+		return rc;
+
+	rc = process_deletions(p, &record_handler, cs, offsets, clean);
+	for (i = 0; i < offsets->len; i++)
+		if (g_array_index(offsets, long, i) < 0)
+			long_array_invert(offsets, i);
+	return rc;
+}
+#endif
+
+/*
+ * Compare CLEAN and DATA as compare_streams does, saving the changes
+ * found in CS.  Return 0 on success, -1 on parse error.
+ *
+ * Large mapped files are compared in parallel.
+ */
+int
+changeset_record(tchangeset *cs,
+		 tparser *p,
+		 GArray *offsets,
+		 GArray *digests,
+		 FILE *clean,
+		 FILE *data,
+		 tmapped *maps,
+		 long *error_position,
+		 long *syntax_error_position)
+{
+#ifdef HAVE_FMEMOPEN
+	if (maps && !changeset_record_parallel(
+		    cs, p, offsets, digests, clean, maps))
+	{
+		*error_position = maps->datalen;
+		if (syntax_error_position)
+			*syntax_error_position = maps->datalen;
+		return 0;
+	}
+#endif
+	return compare_streams(p, &record_handler, cs, offsets, digests,
+			       clean, data, maps, error_position,
+			       syntax_error_position);
+}
+
+static int
+replay_change(tchange *c, thandler *handler, void *userdata)
+{
+	switch (c->op) {
+	case CHANGE_MODIFY:
+		return handler->change(
+			c->key, c->dn1, c->dn2, c->mods, userdata);
+	case CHANGE_RENAME:
+		return handler->rename(c->key, c->dn1, c->entry, userdata);
+	case CHANGE_ADD:
+		return handler->add(c->key, c->dn1, c->mods, userdata);
+	case CHANGE_DELETE:
+		return handler->delete(c->key, c->dn1, userdata);
+	case CHANGE_RENAME0:
+		return handler->rename0(
+			c->key, c->dn1, c->dn2, c->deleteoldrdn, userdata);
+	default:
+		abort();
+	}
+}
+
+/*
+ * After a failed replay:  the first NDONE handler calls have been made
+ * already, and the next one returned RC.  See resume_handler.
+ */
+struct resume_context {
+	thandler *handler;
+	void *userdata;
+	int ndone;
+	int rc;
+};
+
+/*
+ * Return true if the current call has been made already, with its result
+ * in *RC.
+ */
+static int
+resume_skip(struct resume_context *ctx, int *rc)
+{
+	if (ctx->ndone < 0)
+		return 0;
+	*rc = ctx->ndone ? 0 : ctx->rc;
+	ctx->ndone--;
+	return 1;
+}
+
+static int
+resume_change(int key, char *labeldn, char *dn, LDAPMod **mods, void *x)
+{
+	struct resume_context *ctx = x;
+	int rc;
+	if (resume_skip(ctx, &rc)) return rc;
+	return ctx->handler->change(key, labeldn, dn, mods, ctx->userdata);
+}
+
+static int
+resume_rename(int key, char *olddn, tentry *modified, void *x)
+{
+	struct resume_context *ctx = x;
+	int rc;
+	if (resume_skip(ctx, &rc)) return rc;
+	return ctx->handler->rename(key, olddn, modified, ctx->userdata);
+}
+
+static int
+resume_add(int key, char *dn, LDAPMod **mods, void *x)
+{
+	struct resume_context *ctx = x;
+	int rc;
+	if (resume_skip(ctx, &rc)) return rc;
+	return ctx->handler->add(key, dn, mods, ctx->userdata);
+}
+
+static int
+resume_delete(int key, char *dn, void *x)
+{
+	struct resume_context *ctx = x;
+	int rc;
+	if (resume_skip(ctx, &rc)) return rc;
+	return ctx->handler->delete(key, dn, ctx->userdata);
+}
+
+static int
+resume_rename0(int key, char *dn1, char *dn2, int deleteoldrdn, void *x)
+{
+	struct resume_context *ctx = x;
+	int rc;
+	if (resume_skip(ctx, &rc)) return rc;
+	return ctx->handler->rename0(
+		key, dn1, dn2, deleteoldrdn, ctx->userdata);
+}
+
+static thandler resume_handler = {
+	resume_change,
+	resume_rename,
+	resume_add,
+	resume_delete,
+	resume_rename0
+};
+
+/*
+ * Pass the changes saved in CS to HANDLER, with the same result as
+ * compare_streams on the files CS was recorded from, which must not have
+ * changed since.  OFFSETS must also be as they were.
+ *
+ * As long as the handler succeeds, nothing is parsed.  If it fails,
+ * compare_streams runs again to recover exactly the state it would have
+ * left behind, skipping the calls already made, and its result is
+ * returned.
+ */
+int
+changeset_replay(tchangeset *cs,
+		 tparser *p,
+		 thandler *handler,
+		 void *userdata,
+		 GArray *offsets,
+		 GArray *digests,
+		 FILE *clean,
+		 FILE *data,
+		 tmapped *maps,
+		 long *error_position)
+{
+	struct resume_context ctx;
+	int i;
+	int rc = 0;
+
+	for (i = 0; i < cs->changes->len; i++)
+		if ( (rc = replay_change(
+			      g_ptr_array_index(cs->changes, i),
+			      handler,
+			      userdata)))
+			break;
+	if (!rc)
+		return 0;
+
+	ctx.handler = handler;
+	ctx.userdata = userdata;
+	ctx.ndone = i;
+	ctx.rc = rc;
+	return compare_streams(p, &resume_handler, &ctx, offsets, digests,
+			       clean, data, maps, error_position, 0);
+}
@@ -20,6 +20,7 @@
 #include <fcntl.h>
 #include <glib.h>
 #include <ldap.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -55,3 +56,27 @@ ldaperr(LDAP *ld, char *str)
 	ldap_perror(ld, str);
 	exit(1);
 }
+
+/*
+ * Error messages about the input.  A thread that parses speculatively
+ * (see diff.c) can turn them off for itself with quiet_complaints().
+ */
+static GPrivate quiet_key;
+
+void
+quiet_complaints(int quiet)
+{
+	g_private_set(&quiet_key, GINT_TO_POINTER(quiet));
+}
+
+void
+complain(FILE *s, char *fmt, ...)
+{
+	va_list ap;
+
+	if (g_private_get(&quiet_key))
+		return;
+	va_start(ap, fmt);
+	vfprintf(s, fmt, ap);
+	va_end(ap);
+}
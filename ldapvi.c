@@ -22,6 +22,7 @@
 #include <signal.h>
 #include <term.h>
 #include "common.h"
+#include "config.h"
 
 typedef void (*handler_entry)(char *, tentry *, void *);
 static void parse_file(
@@ -30,21 +31,147 @@ static void cut_datafile(char *, long, cmdline *);
 static int write_file_header(FILE *, cmdline *);
 static int rebind(LDAP *, bind_options *, int, char *, int);
 
+/* digests of the entries in the clean file, as recorded by search() */
+static GArray *digests = 0;
+
+/*
+ * The session directory, and whether to keep it on exit because a
+ * commit is in progress and can be resumed from its journal.
+ */
+static char *session_dir = 0;
+static int keep_session = 0;
+
+/* with --resume:  numbers of the updates the journal lists as done */
+static GHashTable *resume_done = 0;
+
+/*
+ * The changes found by the last comparison, and what they were computed
+ * from.  The clean file only ever grows, so its size is enough to tell
+ * whether it has changed.  For the data file, a timestamp is too coarse
+ * on some file systems to catch a quick edit of the same size, so its
+ * contents are hashed as well.
+ */
+static tchangeset *changeset = 0;
+static struct changeset_source {
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	time_t mtime;
+	long mtime_nsec;
+	guint64 hash;
+	off_t cleansize;
+	GArray *offsets;
+} changeset_source;
+
+static guint64
+hash_stream(FILE *s, tmapped *maps)
+{
+	guint64 h = FNV_BASIS;
+	char buf[4096];
+	size_t n;
+
+	if (maps->data)
+		return fnv_hash(h, maps->data, maps->datalen);
+	if (fseek(s, 0, SEEK_SET) == -1) syserr();
+	while ( (n = fread(buf, 1, sizeof(buf), s)))
+		h = fnv_hash(h, buf, n);
+	if (ferror(s)) syserr();
+	if (fseek(s, 0, SEEK_SET) == -1) syserr();
+	return h;
+}
+
+static void
+get_changeset_source(struct changeset_source *source,
+		     FILE *clean, FILE *data, GArray *offsets)
+{
+	struct stat st;
+
+	if (fstat(fileno(data), &st) == -1) syserr();
+	source->dev = st.st_dev;
+	source->ino = st.st_ino;
+	source->size = st.st_size;
+	source->mtime = st.st_mtime;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+	source->mtime_nsec = st.st_mtim.tv_nsec;
+#else
+	source->mtime_nsec = 0;
+#endif
+	if (fstat(fileno(clean), &st) == -1) syserr();
+	source->cleansize = st.st_size;
+	source->offsets = offsets;
+}
+
+static int
+changeset_source_equal(struct changeset_source *a,
+		       struct changeset_source *b)
+{
+	return a->dev == b->dev
+		&& a->ino == b->ino
+		&& a->size == b->size
+		&& a->mtime == b->mtime
+		&& a->mtime_nsec == b->mtime_nsec
+		&& a->hash == b->hash
+		&& a->cleansize == b->cleansize
+		&& a->offsets->len == b->offsets->len
+		&& !memcmp(a->offsets->data,
+			   b->offsets->data,
+			   a->offsets->len * sizeof(long));
+}
+
+/*
+ * Compare the clean and data files, calling HANDLER for each change.
+ *
+ * The changes are computed only once for each version of the files and
+ * then replayed from memory, so that looking at the statistics, viewing
+ * the changes, and committing them does not parse everything again.
+ */
 static int
 compare(tparser *p, thandler *handler, void *userdata, GArray *offsets,
 	char *cleanname, char *dataname, long *error_position,
 	cmdline *cmdline)
 {
 	FILE *clean, *data;
-	int rc;
+	tmapped maps;
+	struct changeset_source source;
+	int rc = 0;
 	long pos;
 
 	if ( !(clean = fopen(cleanname, "r+"))) syserr();
 	if ( !(data = fopen(dataname, "r"))) syserr();
-	rc = compare_streams(p, handler, userdata, offsets, clean, data, &pos,
-			     error_position);
+	get_changeset_source(&source, clean, data, offsets);
+	map_streams(&maps, clean, &data);
+	source.hash = hash_stream(data, &maps);
+
+	if (!changeset || !changeset_source_equal(&source, &changeset_source))
+	{
+		if (changeset) {
+			changeset_free(changeset);
+			g_array_free(changeset_source.offsets, 1);
+			changeset = 0;
+		}
+		changeset = changeset_new();
+		rc = changeset_record(changeset, p, offsets, digests, clean,
+				      data, &maps, &pos, error_position);
+		if (rc) {
+			changeset_free(changeset);
+			changeset = 0;
+		} else {
+			changeset_source = source;
+			changeset_source.offsets = g_array_sized_new(
+				0, 0, sizeof(long), offsets->len);
+			g_array_append_vals(changeset_source.offsets,
+					    offsets->data,
+					    offsets->len);
+			if (fseek(data, 0, SEEK_SET) == -1) syserr();
+		}
+	}
+	if (!rc)
+		rc = changeset_replay(changeset, p, handler, userdata,
+				      offsets, digests, clean, data, &maps,
+				      &pos);
 	if (fclose(clean) == EOF) syserr();
 	if (fclose(data) == EOF) syserr();
+	unmap_streams(&maps);
 
 	if (rc == -2) {
 		/* an error has happened */
@@ -75,6 +202,13 @@ cleanup(int rc, char *pathname)
 	int len;
 	struct termios term;
 
+	if (keep_session) {
+		fprintf(stderr,
+			"Commit interrupted, use --resume %s to continue.\n",
+			pathname);
+		goto reset_terminal;
+	}
+
 	/*
 	 * delete temporary directory
 	 */
@@ -90,6 +224,8 @@ cleanup(int rc, char *pathname)
 		}
 	if (closedir(dir) == -1) syserr();
 	if (rmdir(pathname) == -1) syserr();
+
+reset_terminal:
 	g_string_free(str, 1);
 
 	/*
@@ -109,8 +245,13 @@ cleanup_signal(int n)
 	exit(2);
 }
 
+/*
+ * Rename OLD to NEW.  If MSGIDP is non-null, only send the request and
+ * store its message ID in *MSGIDP.
+ */
 static int
-moddn(LDAP *ld, char *old, char *new, int dor, LDAPControl **ctrls)
+moddn(LDAP *ld, char *old, char *new, int dor, LDAPControl **ctrls,
+      int *msgidp)
 {
 	int rc;
 	char **newrdns = ldap_explode_dn(new, 0);
@@ -126,32 +267,1351 @@ moddn(LDAP *ld, char *old, char *new, int dor, LDAPControl **ctrls)
 		}
 	} else
 		newrdn = "";
-	rc = ldap_rename_s(ld, old, newrdn, newsup->str, dor, ctrls, 0);
+	if (msgidp)
+		rc = ldap_rename(
+			ld, old, newrdn, newsup->str, dor, ctrls, 0, msgidp);
+	else
+		rc = ldap_rename_s(
+			ld, old, newrdn, newsup->str, dor, ctrls, 0);
 	g_string_free(newsup, 1);
 	ldap_value_free(newrdns);
 	return rc;
 }
 
-
-/*****************************************
- * ldapmodify_handler
+
+/*****************************************
+ * ldapmodify_handler
+ */
+typedef struct tchannel {
+	LDAP *ld;
+	GHashTable *pending;		/* msgid -> tpending */
+} tchannel;
+
+/*
+ * Flow control for pipelined updates, see governor_success.
+ */
+typedef struct tgovernor {
+	double limit;			/* current window, 1 <= LIMIT <= WINDOW */
+	double threshold;		/* end of slow start */
+	double srtt;			/* smoothed latency */
+	double minrtt;			/* lowest latency seen */
+	double last_decrease;
+	double start;
+	int reported;			/* window last printed */
+	int nresults;
+	double max_rate;		/* updates per second, or 0 */
+	double next_send;
+} tgovernor;
+
+struct ldapmodify_context {
+	LDAP *ld;
+	LDAPControl **controls;
+	int verbose;
+	int noquestions;
+	int continuous;
+	int window;			/* requests in flight per channel */
+	tchannel *channels;		/* channels[0].ld is LD */
+	int nchannels;
+	tgovernor governor;
+	GPtrArray *retries;		/* tpendings waiting to be resent */
+	int txnsize;			/* updates per transaction, or 0 */
+	struct berval *txnid;		/* the open transaction, if any */
+	LDAPControl txnctrl;
+	LDAPControl **txnctrls;		/* CONTROLS plus TXNCTRL */
+	GPtrArray *txnops;		/* tpendings sent with TXNID */
+	GHashTable *held;		/* dn_key -> tmodify, or null */
+	GPtrArray *order;		/* tmodify, first one first */
+	FILE *journal;			/* or null */
+	int seq;			/* number of the current update */
+	int deferred;			/* outcome will be journalled later */
+	int failed;			/* error ignored */
+	int unsynced;			/* journal records not yet synced */
+	double last_sync;
+};
+
+static int
+ldapmodify_error_on(struct ldapmodify_context *ctx, LDAP *ld, char *error)
+{
+	ldap_perror(ld, error);
+	ctx->failed = 1;
+	if (!ctx->continuous)
+		return -1;
+	fputs("(error ignored)\n", stderr);
+	return 0;
+}
+
+static int
+ldapmodify_error(struct ldapmodify_context *ctx, char *error)
+{
+	return ldapmodify_error_on(ctx, ctx->ld, error);
+}
+
+/*
+ * Pipelined updates.
+ *
+ * With --continue, errors do not stop processing, so there is no need to
+ * wait for each result before sending the next request.  Up to WINDOW
+ * requests are kept in flight on each of the NCHANNELS connections, and
+ * each request goes to the least busy connection.  A request is held
+ * back while one for the same DN, a parent, or a child is still
+ * outstanding on any connection, so that parents are added before their
+ * children and children deleted before their parents.  Renames change
+ * the DN of a whole subtree and are sent only when everything else has
+ * completed.  Deletions are sent the same way unless they might need to
+ * ask about non-leaf entries.
+ */
+typedef struct trecord {
+	int seq;
+	int key;
+	LDAPMod **mods;
+} trecord;
+
+typedef struct tpending {
+	char *what;
+	int type;			/* LDAP_REQ_MODIFY, _ADD, or _DELETE */
+	int key;
+	char *dn;
+	char **rdns;
+	LDAPMod **mods;			/* a copy, for retries */
+	int seq;			/* for the journal */
+	int msgid;
+	int tries;
+	tchannel *channel;		/* where it was sent */
+	double due;			/* when to resend it, see RETRIES */
+	int replacing;			/* MODS rewritten by mods_replacing */
+	int answered;			/* see txn_collect */
+	GPtrArray *records;		/* trecords merged into MODS, or null */
+	double sent;
+} tpending;
+
+#define PENDING_RETRIES 3
+
+static tpending *
+pending_new(char *what, int type, int key, char *dn, char **rdns,
+	    LDAPMod **mods)
+{
+	tpending *op = xalloc(sizeof(tpending));
+	op->what = what;
+	op->type = type;
+	op->key = key;
+	op->dn = xdup(dn);
+	op->rdns = rdns;
+	op->mods = mods ? mods_copy(mods) : 0;
+	op->seq = -1;
+	op->msgid = -1;
+	op->tries = 0;
+	op->channel = 0;
+	op->due = 0;
+	op->replacing = 0;
+	op->answered = 0;
+	op->records = 0;
+	op->sent = 0;
+	return op;
+}
+
+static void
+records_free(GPtrArray *records)
+{
+	int i;
+
+	for (i = 0; i < records->len; i++) {
+		trecord *r = g_ptr_array_index(records, i);
+		ldap_mods_free(r->mods, 1);
+		free(r);
+	}
+	g_ptr_array_free(records, 1);
+}
+
+static void
+pending_free(tpending *op)
+{
+	free(op->dn);
+	if (op->rdns) ldap_value_free(op->rdns);
+	if (op->mods) ldap_mods_free(op->mods, 1);
+	if (op->records) records_free(op->records);
+	free(op);
+}
+
+static double
+now_seconds(void)
+{
+	struct timeval tv;
+
+	if (gettimeofday(&tv, 0) == -1) syserr();
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static int
+ldapmodify_async_p(struct ldapmodify_context *ctx)
+{
+	return (ctx->window > 1 || ctx->nchannels > 1) && ctx->continuous;
+}
+
+static int
+ldapmodify_npending(struct ldapmodify_context *ctx)
+{
+	int result = ctx->retries->len;
+	int i;
+
+	for (i = 0; i < ctx->nchannels; i++)
+		result += g_hash_table_size(ctx->channels[i].pending);
+	return result;
+}
+
+/*
+ * Return true if the DNs given as RDN arrays are the same or one of them
+ * lies below the other.
+ */
+static int
+rdns_related(char **a, char **b)
+{
+	int i = 0;
+	int j = 0;
+
+	if (!a || !b)
+		return 1;
+	while (a[i]) i++;
+	while (b[j]) j++;
+	while (i > 0 && j > 0)
+		if (strcasecmp(a[--i], b[--j]))
+			return 0;
+	return 1;
+}
+
+/*
+ * Wait for the next response on any of the channels, or until TIMEOUT
+ * (if non-null) has passed, returning null.
+ */
+static LDAPMessage *
+ldapmodify_wait(struct ldapmodify_context *ctx, tchannel **result,
+		struct timeval *timeout)
+{
+	struct timeval zero = {0, 0};
+	LDAPMessage *msg;
+	int i;
+
+	if (ctx->nchannels == 1) {
+		*result = ctx->channels;
+		switch (ldap_result(ctx->ld, LDAP_RES_ANY, LDAP_MSG_ONE,
+				    timeout, &msg))
+		{
+		case -1:
+			ldaperr(ctx->ld, "ldap_result");
+		case 0:
+			if (!timeout) ldaperr(ctx->ld, "ldap_result");
+			return 0;
+		default:
+			return msg;
+		}
+	}
+
+	for (;;) {
+		fd_set fds;
+		int maxfd = -1;
+
+		FD_ZERO(&fds);
+		for (i = 0; i < ctx->nchannels; i++) {
+			tchannel *channel = &ctx->channels[i];
+			int fd;
+
+			if (!g_hash_table_size(channel->pending))
+				continue;
+			switch (ldap_result(channel->ld, LDAP_RES_ANY,
+					    LDAP_MSG_ONE, &zero, &msg))
+			{
+			case -1:
+				ldaperr(channel->ld, "ldap_result");
+			case 0:
+				break;
+			default:
+				*result = channel;
+				return msg;
+			}
+			if (ldap_get_option(channel->ld, LDAP_OPT_DESC, &fd))
+				ldaperr(channel->ld,
+					"ldap_get_option(LDAP_OPT_DESC)");
+			FD_SET(fd, &fds);
+			if (fd > maxfd) maxfd = fd;
+		}
+		if (maxfd == -1) abort();
+		switch (select(maxfd + 1, &fds, 0, 0, timeout)) {
+		case -1:
+			if (errno != EINTR) syserr();
+			break;
+		case 0:
+			if (timeout) return 0;
+		}
+	}
+}
+
+/*
+ * The journal.
+ *
+ * While committing, every update whose result has arrived is appended
+ * to the file "journal" in the session directory, as a line
+ *   <number> ok|error <key> <dn>
+ * where <number> counts the handler calls made by compare_streams.
+ * The comparison is deterministic, so after an interruption --resume
+ * can repeat it and skip the numbers listed.  The journal is synced
+ * every JOURNAL_SYNC_RECORDS records or JOURNAL_SYNC_SECONDS seconds,
+ * whichever comes first, so a crash loses at most that much, and those
+ * updates are simply sent again.
+ */
+#define JOURNAL_SYNC_RECORDS 1024
+#define JOURNAL_SYNC_SECONDS 1
+
+static void
+journal_sync(struct ldapmodify_context *ctx)
+{
+	if (fflush(ctx->journal) == EOF) syserr();
+	if (fsync(fileno(ctx->journal)) == -1) syserr();
+	ctx->unsynced = 0;
+	ctx->last_sync = now_seconds();
+}
+
+static void
+journal_record(struct ldapmodify_context *ctx,
+	       int seq, int key, char *dn, int ok)
+{
+	if (!ctx->journal)
+		return;
+	fprintf(ctx->journal, "%d %s %d %s\n",
+		seq, ok ? "ok" : "error", key, dn);
+	if (++ctx->unsynced >= JOURNAL_SYNC_RECORDS
+	    || now_seconds() - ctx->last_sync >= JOURNAL_SYNC_SECONDS)
+		journal_sync(ctx);
+}
+
+static void
+journal_record_pending(struct ldapmodify_context *ctx, tpending *op, int ok)
+{
+	int i;
+
+	if (!op->records) {
+		journal_record(ctx, op->seq, op->key, op->dn, ok);
+		return;
+	}
+	for (i = 0; i < op->records->len; i++) {
+		trecord *r = g_ptr_array_index(op->records, i);
+		journal_record(ctx, r->seq, r->key, op->dn, ok);
+	}
+}
+
+/*
+ * The window is adjusted as in TCP congestion control:  It starts at 1
+ * and grows by one for each successful update until THRESHOLD is
+ * reached (one doubling per round trip), then by one per window's worth
+ * of updates, up to --window.  When the server reports that it is busy,
+ * unavailable, or out of time, the window is halved, at most once per
+ * round trip.
+ *
+ * Latency alone is no sign of overload, since a larger window means
+ * that requests wait in the server's queue for longer.  Instead, as in
+ * TCP Vegas, the window is compared against the number of requests the
+ * server works through in the lowest latency seen: the difference is
+ * the number of requests queued.  While it is below QUEUED_MIN, the
+ * window grows; above QUEUED_MAX, a larger window only adds latency
+ * without speeding things up, so it shrinks again by one per window's
+ * worth of updates.
+ */
+#define QUEUED_MIN 1
+#define QUEUED_MAX 3
+
+static void
+governor_init(tgovernor *governor, int window, int max_rate)
+{
+	governor->limit = 1;
+	governor->threshold = window;
+	governor->srtt = 0;
+	governor->minrtt = 0;
+	governor->last_decrease = 0;
+	governor->start = now_seconds();
+	governor->reported = 1;
+	governor->nresults = 0;
+	governor->max_rate = max_rate;
+	governor->next_send = 0;
+}
+
+static void
+governor_report(struct ldapmodify_context *ctx)
+{
+	tgovernor *governor = &ctx->governor;
+	int n = governor->limit;
+
+	if (!ctx->verbose || n == governor->reported)
+		return;
+	governor->reported = n;
+	printf("(window %d after %d updates, %.1fs, latency %.0fms)\n",
+	       n,
+	       governor->nresults,
+	       now_seconds() - governor->start,
+	       governor->srtt * 1000);
+}
+
+static void
+governor_decrease(struct ldapmodify_context *ctx, double now)
+{
+	tgovernor *governor = &ctx->governor;
+
+	if (now - governor->last_decrease < governor->srtt)
+		return;
+	governor->limit = MAX(1, governor->limit / 2);
+	governor->threshold = governor->limit;
+	governor->last_decrease = now;
+	governor_report(ctx);
+}
+
+static void
+governor_success(struct ldapmodify_context *ctx, double latency, double now)
+{
+	tgovernor *governor = &ctx->governor;
+	double queued;
+
+	if (!governor->minrtt || latency < governor->minrtt)
+		governor->minrtt = latency;
+	queued = governor->srtt
+		? governor->limit * (1 - governor->minrtt / governor->srtt)
+		: 0;
+	if (queued > QUEUED_MAX) {
+		/* the server is saturated */
+		governor->limit = MAX(1, governor->limit - 1 / governor->limit);
+		governor->threshold = MIN(governor->threshold, governor->limit);
+	} else if (queued >= QUEUED_MIN)
+		/* just right; end slow start */
+		governor->threshold = MIN(governor->threshold, governor->limit);
+	else if (governor->limit < governor->threshold)
+		governor->limit += 1;
+	else
+		governor->limit += 1 / governor->limit;
+	if (governor->limit > ctx->window)
+		governor->limit = ctx->window;
+	governor_report(ctx);
+}
+
+static int
+governor_overload_p(int err)
+{
+	return err == LDAP_BUSY
+		|| err == LDAP_UNAVAILABLE
+		|| err == LDAP_TIMELIMIT_EXCEEDED;
+}
+
+/*
+ * Wait as long as necessary to stay below --max-rate.
+ */
+static void
+governor_throttle(tgovernor *governor)
+{
+	double now;
+
+	if (!governor->max_rate)
+		return;
+	now = now_seconds();
+	if (governor->next_send > now)
+		g_usleep((governor->next_send - now) * 1e6);
+	governor->next_send
+		= MAX(now, governor->next_send) + 1 / governor->max_rate;
+}
+
+/*
+ * Send OP on CHANNEL.  Returns the libldap error code.
+ */
+static int
+pending_send(struct ldapmodify_context *ctx, tchannel *channel,
+	     tpending *op)
+{
+	LDAP *ld = channel->ld;
+	LDAPControl **ctrls = ctx->controls;
+	int rc;
+
+	switch (op->type) {
+	case LDAP_REQ_MODIFY:
+		rc = ldap_modify_ext(
+			ld, op->dn, op->mods, ctrls, 0, &op->msgid);
+		break;
+	case LDAP_REQ_ADD:
+		rc = ldap_add_ext(ld, op->dn, op->mods, ctrls, 0, &op->msgid);
+		break;
+	case LDAP_REQ_DELETE:
+		rc = ldap_delete_ext(ld, op->dn, ctrls, 0, &op->msgid);
+		break;
+	default:
+		abort();
+	}
+	if (!rc) {
+		op->channel = channel;
+		op->sent = now_seconds();
+		g_hash_table_insert(
+			channel->pending, GINT_TO_POINTER(op->msgid), op);
+	}
+	return rc;
+}
+
+static void
+print_key_entry(int key, char *dn)
+{
+	if (key >= 0)
+		fprintf(stderr, "\tentry %d: %s\n", key, dn);
+	else
+		fprintf(stderr, "\tentry: %s\n", dn);
+}
+
+static void
+print_pending_entry(tpending *op)
+{
+	print_key_entry(op->key, op->dn);
+}
+
+/*
+ * Send OP (again), or report the error and give up on it.
+ */
+static void
+pending_resend(struct ldapmodify_context *ctx, tchannel *channel,
+	       tpending *op)
+{
+	if (!pending_send(ctx, channel, op))
+		return;
+	ldap_perror(channel->ld, op->what);
+	print_pending_entry(op);
+	fputs("(error ignored)\n", stderr);
+	journal_record_pending(ctx, op, 0);
+	pending_free(op);
+}
+
+/*
+ * compare_values() expresses changes of attribute values as deletions
+ * and additions of individual values, which servers cannot carry out
+ * for attributes without an equality matching rule, like jpegPhoto.
+ * Return modifications equivalent to MODS that replace those attributes
+ * as a whole, based on the values DN currently has, or null if the entry
+ * cannot be read.  Values are compared byte by byte.
+ */
+static LDAPMod **
+mods_replacing(LDAP *ld, char *dn, LDAPMod **mods)
+{
+	GPtrArray *ads = g_ptr_array_new();
+	GPtrArray *result = g_ptr_array_new();
+	LDAPMessage *res = 0;
+	LDAPMessage *entry = 0;
+	int i, j, k;
+
+	for (i = 0; mods[i]; i++) {
+		LDAPMod *m = mods[i];
+		if ((m->mod_op & ~LDAP_MOD_BVALUES) == LDAP_MOD_REPLACE
+		    || !(m->mod_op & LDAP_MOD_BVALUES))
+			continue;
+		for (j = 0; j < ads->len; j++)
+			if (!strcasecmp(g_ptr_array_index(ads, j), m->mod_type))
+				break;
+		if (j == ads->len)
+			g_ptr_array_add(ads, m->mod_type);
+	}
+	if (!ads->len) {
+		g_ptr_array_free(ads, 1);
+		g_ptr_array_free(result, 1);
+		return 0;
+	}
+	g_ptr_array_add(ads, 0);
+	if (ldap_search_ext_s(ld, dn, LDAP_SCOPE_BASE, 0,
+			      (char **) ads->pdata, 0, 0, 0, 0, 0, &res)
+	    || !(entry = ldap_first_entry(ld, res)))
+	{
+		if (res) ldap_msgfree(res);
+		g_ptr_array_free(ads, 1);
+		g_ptr_array_free(result, 1);
+		return 0;
+	}
+	g_ptr_array_set_size(ads, ads->len - 1);
+
+	/* the other modifications stay as they are */
+	for (i = 0; mods[i]; i++) {
+		LDAPMod *one[2];
+		LDAPMod **copy;
+
+		for (j = 0; j < ads->len; j++)
+			if (!strcasecmp(g_ptr_array_index(ads, j),
+					mods[i]->mod_type))
+				break;
+		if (j < ads->len)
+			continue;
+		one[0] = mods[i];
+		one[1] = 0;
+		copy = mods_copy(one);
+		g_ptr_array_add(result, copy[0]);
+		free(copy);
+	}
+
+	for (j = 0; j < ads->len; j++) {
+		char *ad = g_ptr_array_index(ads, j);
+		struct berval **current = ldap_get_values_len(ld, entry, ad);
+		GPtrArray *values = g_ptr_array_new();
+		LDAPMod *r;
+
+		for (k = 0; current && current[k]; k++)
+			g_ptr_array_add(values, ber_bvdup(current[k]));
+		if (current) ldap_value_free_len(current);
+
+		for (i = 0; mods[i]; i++) {
+			LDAPMod *m = mods[i];
+			struct berval **bv = m->mod_bvalues;
+			int op = m->mod_op & ~LDAP_MOD_BVALUES;
+			int l;
+
+			if (strcasecmp(m->mod_type, ad))
+				continue;
+			if (op == LDAP_MOD_REPLACE
+			    || (op == LDAP_MOD_DELETE && !bv))
+			{
+				for (k = 0; k < values->len; k++)
+					ber_bvfree(g_ptr_array_index(
+							   values, k));
+				g_ptr_array_set_size(values, 0);
+			}
+			for (l = 0; bv && bv[l]; l++) {
+				if (op != LDAP_MOD_DELETE) {
+					g_ptr_array_add(
+						values, ber_bvdup(bv[l]));
+					continue;
+				}
+				for (k = 0; k < values->len; k++) {
+					struct berval *v
+						= g_ptr_array_index(values, k);
+					if (v->bv_len == bv[l]->bv_len
+					    && !memcmp(v->bv_val,
+						       bv[l]->bv_val,
+						       v->bv_len))
+					{
+						ber_bvfree(v);
+						g_ptr_array_remove_index(
+							values, k);
+						break;
+					}
+				}
+			}
+		}
+
+		r = xalloc(sizeof(LDAPMod));
+		r->mod_op = LDAP_MOD_REPLACE | LDAP_MOD_BVALUES;
+		r->mod_type = xdup(ad);
+		g_ptr_array_add(values, 0);
+		r->mod_bvalues = (struct berval **) values->pdata;
+		g_ptr_array_free(values, 0);
+		g_ptr_array_add(result, r);
+	}
+
+	ldap_msgfree(res);
+	g_ptr_array_free(ads, 1);
+	g_ptr_array_add(result, 0);
+	{
+		LDAPMod **replaced = (LDAPMod **) result->pdata;
+		g_ptr_array_free(result, 0);
+		return replaced;
+	}
+}
+
+/*
+ * A modify has failed.  If the server could not match values, try again
+ * with mods_replacing().  Returns the error code.
+ */
+static int
+modify_replacing(struct ldapmodify_context *ctx, char *dn, LDAPMod **mods)
+{
+	LDAP *ld = ctx->ld;
+	LDAPMod **replacing;
+	int err;
+
+	if (ldap_get_option(ld, LDAP_OPT_RESULT_CODE, &err))
+		ldaperr(ld, "ldap_get_option(LDAP_OPT_RESULT_CODE)");
+	if (err != LDAP_INAPPROPRIATE_MATCHING)
+		return err;
+	if ( !(replacing = mods_replacing(ld, dn, mods))) {
+		ldap_set_option(ld, LDAP_OPT_RESULT_CODE, &err);
+		return err;
+	}
+	if (ctx->verbose) printf("(retrying with replace) %s\n", dn);
+	err = ldap_modify_ext_s(ld, dn, replacing, ctx->controls, 0);
+	ldap_mods_free(replacing, 1);
+	return err;
+}
+
+/*
+ * A modify of DN merged from RECORDS (see "Coalescing") has failed.
+ * Send the records one at a time, so that only the faulty ones are
+ * lost, and journal each.
+ */
+static void
+records_split(struct ldapmodify_context *ctx, char *dn, GPtrArray *records)
+{
+	LDAP *ld = ctx->ld;
+	int i;
+
+	if (ctx->verbose) printf("(retrying one by one) %s\n", dn);
+	for (i = 0; i < records->len; i++) {
+		trecord *r = g_ptr_array_index(records, i);
+		int ok = !ldap_modify_ext_s(ld, dn, r->mods, ctx->controls, 0)
+			|| !modify_replacing(ctx, dn, r->mods);
+
+		if (!ok) {
+			ldap_perror(ld, "ldap_modify");
+			print_key_entry(r->key, dn);
+			fputs("(error ignored)\n", stderr);
+		}
+		journal_record(ctx, r->seq, r->key, dn, ok);
+	}
+}
+
+/*
+ * Retries.
+ *
+ * An update rejected because the server is busy is resent after a
+ * backoff.  Meanwhile, it waits in RETRIES, where it still holds back
+ * related updates, and other requests keep flowing.
+ */
+static void
+retry_later(struct ldapmodify_context *ctx, tpending *op, double now)
+{
+	op->due = now + ctx->governor.srtt * op->tries;
+	g_ptr_array_add(ctx->retries, op);
+}
+
+/*
+ * Resend the retries that are due.  Returns the time until the next one
+ * is, or -1 if there are none left.
+ */
+static double
+retry_due(struct ldapmodify_context *ctx)
+{
+	double now = now_seconds();
+	double next = -1;
+	int i = 0;
+
+	while (i < ctx->retries->len) {
+		tpending *op = g_ptr_array_index(ctx->retries, i);
+		if (op->due <= now) {
+			g_ptr_array_remove_index(ctx->retries, i);
+			governor_throttle(&ctx->governor);
+			pending_resend(ctx, op->channel, op);
+			continue;
+		}
+		if (next == -1 || op->due - now < next)
+			next = op->due - now;
+		i++;
+	}
+	return next;
+}
+
+/*
+ * Wait for one response and report it if it is an error.
+ */
+static void
+ldapmodify_result(struct ldapmodify_context *ctx)
+{
+	tchannel *channel;
+	LDAPMessage *result;
+	LDAP *ld;
+	int msgid;
+	tpending *op;
+	char *matched = 0;
+	char *text = 0;
+	int err;
+	double now;
+
+	for (;;) {
+		double next = retry_due(ctx);
+		struct timeval tv;
+
+		if (!ldapmodify_npending(ctx))
+			/* the retries could not be sent */
+			return;
+		if (next == -1) {
+			result = ldapmodify_wait(ctx, &channel, 0);
+			break;
+		}
+		if (ldapmodify_npending(ctx) == ctx->retries->len) {
+			/* nothing else in flight */
+			g_usleep(next * 1e6);
+			continue;
+		}
+		tv.tv_sec = next;
+		tv.tv_usec = (next - tv.tv_sec) * 1e6;
+		if ( (result = ldapmodify_wait(ctx, &channel, &tv)))
+			break;
+	}
+	ld = channel->ld;
+	msgid = ldap_msgid(result);
+	now = now_seconds();
+
+	if (msgid == 0) {
+		/* unsolicited notification, e.g. notice of disconnection */
+		if (ldap_parse_result(ld, result, &err, 0, &text, 0, 0, 1))
+			ldaperr(ld, "ldap_parse_result");
+		fprintf(stderr, "Notice from server: %s (%d)\n",
+			ldap_err2string(err), err);
+		if (text && *text)
+			fprintf(stderr, "\tadditional info: %s\n", text);
+		if (text) ldap_memfree(text);
+		return;
+	}
+	op = g_hash_table_lookup(channel->pending, GINT_TO_POINTER(msgid));
+	if (!op) {
+		fprintf(stderr,
+			"Error: Response to unknown request %d ignored.\n",
+			msgid);
+		ldap_msgfree(result);
+		ctx->failed = 1;
+		return;
+	}
+	g_hash_table_remove(channel->pending, GINT_TO_POINTER(msgid));
+	if (ldap_parse_result(ld, result, &err, &matched, &text, 0, 0, 1))
+		ldaperr(ld, "ldap_parse_result");
+	ctx->governor.nresults++;
+	if (governor_overload_p(err)) {
+		governor_decrease(ctx, now);
+		if (op->tries++ < PENDING_RETRIES) {
+			if (ctx->verbose)
+				printf("(retrying) %s\n", op->dn);
+			if (matched) ldap_memfree(matched);
+			if (text) ldap_memfree(text);
+			retry_later(ctx, op, now);
+			return;
+		}
+	} else if (err == LDAP_INAPPROPRIATE_MATCHING
+		   && op->type == LDAP_REQ_MODIFY && !op->replacing)
+	{
+		LDAPMod **mods = mods_replacing(ld, op->dn, op->mods);
+		if (mods) {
+			if (ctx->verbose)
+				printf("(retrying with replace) %s\n",
+				       op->dn);
+			if (matched) ldap_memfree(matched);
+			if (text) ldap_memfree(text);
+			ldap_mods_free(op->mods, 1);
+			op->mods = mods;
+			op->replacing = 1;
+			pending_resend(ctx, channel, op);
+			return;
+		}
+	} else if (!err)
+		governor_success(ctx, now - op->sent, now);
+	ctx->governor.srtt = ctx->governor.srtt
+		? 0.875 * ctx->governor.srtt + 0.125 * (now - op->sent)
+		: now - op->sent;
+	if (err && op->records && op->records->len > 1) {
+		if (matched) ldap_memfree(matched);
+		if (text) ldap_memfree(text);
+		records_split(ctx, op->dn, op->records);
+		pending_free(op);
+		return;
+	}
+	if (err) {
+		fprintf(stderr, "%s: %s (%d)\n",
+			op->what, ldap_err2string(err), err);
+		if (matched && *matched)
+			fprintf(stderr, "\tmatched DN: %s\n", matched);
+		if (text && *text)
+			fprintf(stderr, "\tadditional info: %s\n", text);
+		print_pending_entry(op);
+		fputs("(error ignored)\n", stderr);
+	}
+	if (matched) ldap_memfree(matched);
+	if (text) ldap_memfree(text);
+	journal_record_pending(ctx, op, !err);
+	pending_free(op);
+}
+
+static gboolean
+pending_related_p(gpointer key, gpointer value, gpointer rdns)
+{
+	return rdns_related(((tpending *) value)->rdns, rdns);
+}
+
+/*
+ * Wait until a request for DN can be sent.  Returns its RDNs and the
+ * channel to use.
+ */
+static char **
+ldapmodify_reserve(struct ldapmodify_context *ctx, char *dn,
+		   tchannel **result)
+{
+	char **rdns = ldap_explode_dn(dn, 0);
+	int i;
+
+	for (;;) {
+		tchannel *best = 0;
+
+		for (i = 0; i < ctx->retries->len; i++)
+			if (rdns_related(((tpending *) g_ptr_array_index(
+						  ctx->retries, i))->rdns,
+					 rdns))
+				break;
+		if (i < ctx->retries->len) {
+			ldapmodify_result(ctx);
+			continue;
+		}
+		for (i = 0; i < ctx->nchannels; i++) {
+			tchannel *channel = &ctx->channels[i];
+			int n = g_hash_table_size(channel->pending);
+
+			if (g_hash_table_find(
+				    channel->pending, pending_related_p, rdns))
+			{
+				best = 0;
+				break;
+			}
+			if (n < (int) ctx->governor.limit
+			    && (!best
+				|| n < g_hash_table_size(best->pending)))
+				best = channel;
+		}
+		if (best) {
+			*result = best;
+			return rdns;
+		}
+		ldapmodify_result(ctx);
+	}
+}
+
+/*
+ * Send an update of the given TYPE once the window and its dependencies
+ * allow it.
+ */
+static int
+ldapmodify_send(struct ldapmodify_context *ctx,
+		char *what, int type, int key, char *dn, LDAPMod **mods)
+{
+	tchannel *channel;
+	char **rdns = ldapmodify_reserve(ctx, dn, &channel);
+	tpending *op = pending_new(what, type, key, dn, rdns, mods);
+
+	op->seq = ctx->seq;
+	if (pending_send(ctx, channel, op)) {
+		pending_free(op);
+		return ldapmodify_error_on(ctx, channel->ld, what);
+	}
+	ctx->deferred = 1;
+	return 0;
+}
+
+static void
+ldapmodify_drain(struct ldapmodify_context *ctx)
+{
+	while (ldapmodify_npending(ctx))
+		ldapmodify_result(ctx);
+}
+
+/*
+ * Transactions (RFC 5805).
+ *
+ * With --transaction K, updates are sent as part of a transaction, which
+ * is committed after K updates and at the end.  If an update or the
+ * commit fails, the server rolls back the whole transaction; we report
+ * the entry at fault and the number of updates that were lost with it.
+ * The updates of a transaction are pipelined on the main connection;
+ * their responses are collected before the transaction is ended.  As
+ * with pipelining, this needs --continue, since the failing update is
+ * not necessarily the one being processed when the error is noticed.
+ */
+#ifndef LDAP_EXOP_TXN_START
+#define LDAP_EXOP_TXN_START "1.3.6.1.1.21.1"
+#endif
+#ifndef LDAP_CONTROL_TXN_SPEC
+#define LDAP_CONTROL_TXN_SPEC "1.3.6.1.1.21.2"
+#endif
+#ifndef LDAP_EXOP_TXN_END
+#define LDAP_EXOP_TXN_END "1.3.6.1.1.21.3"
+#endif
+
+/*
+ * Return true if the root DSE lists OID as a supported extended
+ * operation.
+ */
+static int
+server_supports_extension(LDAP *ld, char *oid)
+{
+	LDAPMessage *result, *entry;
+	char *attrs[2] = {"supportedExtension", 0};
+	char **values;
+	char **ptr;
+	int found = 0;
+
+	if (ldap_search_s(ld, "", LDAP_SCOPE_BASE, 0, attrs, 0, &result)) {
+		ldap_msgfree(result);
+		return 0;
+	}
+	if ( (entry = ldap_first_entry(ld, result))
+	     && (values = ldap_get_values(ld, entry, attrs[0])))
+	{
+		for (ptr = values; *ptr; ptr++)
+			if (!strcmp(*ptr, oid))
+				found = 1;
+		ldap_value_free(values);
+	}
+	ldap_msgfree(result);
+	return found;
+}
+
+static void
+txn_start(struct ldapmodify_context *ctx)
+{
+	char *oid = 0;
+
+	if (ldap_extended_operation_s(ctx->ld, LDAP_EXOP_TXN_START, 0, 0, 0,
+				      &oid, &ctx->txnid))
+	{
+		ldap_perror(ctx->ld, "ldap_txn_start");
+		fputs("Warning: Committing updates individually.\n", stderr);
+		ctx->txnsize = 0;
+		if (ctx->txnid) ber_bvfree(ctx->txnid);
+		ctx->txnid = 0;
+	} else {
+		ctx->txnctrl.ldctl_oid = LDAP_CONTROL_TXN_SPEC;
+		ctx->txnctrl.ldctl_value = *ctx->txnid;
+		ctx->txnctrl.ldctl_iscritical = 1;
+		ctx->txnctrls = controls_with(ctx->controls, &ctx->txnctrl);
+	}
+	if (oid) ldap_memfree(oid);
+}
+
+/*
+ * Return the controls to send an update with, starting a transaction
+ * if necessary.
+ */
+static LDAPControl **
+txn_controls(struct ldapmodify_context *ctx)
+{
+	if (!ctx->txnid)
+		txn_start(ctx);
+	return ctx->txnid ? ctx->txnctrls : ctx->controls;
+}
+
+static void
+txn_rolled_back(struct ldapmodify_context *ctx)
+{
+	int n = ctx->txnops->len;
+
+	if (n)
+		fprintf(stderr,
+			"(%d other update%s in this transaction rolled back)\n",
+			n,
+			n == 1 ? "" : "s");
+}
+
+/*
+ * Wait for the responses to the updates sent in the open transaction.
+ * Failed updates are reported and dropped from TXNOPS.  Returns the
+ * number of failures.
+ */
+static int
+txn_collect(struct ldapmodify_context *ctx)
+{
+	LDAP *ld = ctx->ld;
+	int nfailed = 0;
+	int i = 0;
+
+	while (i < ctx->txnops->len) {
+		tpending *op = g_ptr_array_index(ctx->txnops, i);
+		LDAPMessage *result;
+		char *text = 0;
+		int err;
+
+		if (op->answered) {
+			i++;
+			continue;
+		}
+		if (ldap_result(ld, op->msgid, LDAP_MSG_ONE, 0, &result) <= 0)
+			ldaperr(ld, "ldap_result");
+		if (ldap_parse_result(ld, result, &err, 0, &text, 0, 0, 1))
+			ldaperr(ld, "ldap_parse_result");
+		if (!err) {
+			if (text) ldap_memfree(text);
+			op->answered = 1;
+			i++;
+			continue;
+		}
+		fprintf(stderr, "%s: %s (%d)\n",
+			op->what, ldap_err2string(err), err);
+		if (text && *text)
+			fprintf(stderr, "\tadditional info: %s\n", text);
+		if (text) ldap_memfree(text);
+		print_pending_entry(op);
+		journal_record_pending(ctx, op, 0);
+		g_ptr_array_remove_index(ctx->txnops, i);
+		pending_free(op);
+		nfailed++;
+	}
+	return nfailed;
+}
+
+/*
+ * Commit (or, if COMMIT is false, abort) the open transaction.
+ */
+static void
+txn_end(struct ldapmodify_context *ctx, int commit)
+{
+	LDAP *ld = ctx->ld;
+	BerElement *ber = ber_alloc_t(LBER_USE_DER);
+	struct berval *request = 0;
+	struct berval *response = 0;
+	char *oid = 0;
+	int rc;
+	int i;
+
+	if (txn_collect(ctx) && commit) {
+		txn_rolled_back(ctx);
+		fputs("(error ignored)\n", stderr);
+		commit = 0;
+	}
+	if (commit)
+		ber_printf(ber, "{O}", ctx->txnid);
+	else
+		ber_printf(ber, "{bO}", (ber_int_t) 0, ctx->txnid);
+	if (ber_flatten(ber, &request) == -1)
+		yourfault("ber_flatten");
+	ber_free(ber, 1);
+
+	rc = ldap_extended_operation_s(ld, LDAP_EXOP_TXN_END, request, 0, 0,
+				       &oid, &response);
+	if (rc && commit) {
+		ber_int_t failed = -1;
+		ber_len_t len;
+
+		ldap_perror(ld, "ldap_txn_end");
+		if (response && (ber = ber_init(response))) {
+			if (ber_scanf(ber, "{") != LBER_ERROR
+			    && ber_peek_tag(ber, &len) == LBER_INTEGER)
+				ber_scanf(ber, "i", &failed);
+			ber_free(ber, 1);
+		}
+		for (i = 0; i < ctx->txnops->len; i++) {
+			tpending *op = g_ptr_array_index(ctx->txnops, i);
+			if (op->msgid == failed) {
+				print_pending_entry(op);
+				journal_record_pending(ctx, op, 0);
+				g_ptr_array_remove_index(ctx->txnops, i);
+				pending_free(op);
+				break;
+			}
+		}
+		txn_rolled_back(ctx);
+		fputs("(error ignored)\n", stderr);
+	}
+	if (oid) ldap_memfree(oid);
+	if (response) ber_bvfree(response);
+	ber_bvfree(request);
+
+	for (i = 0; i < ctx->txnops->len; i++) {
+		tpending *op = g_ptr_array_index(ctx->txnops, i);
+		journal_record_pending(ctx, op, commit && !rc);
+		pending_free(op);
+	}
+	g_ptr_array_set_size(ctx->txnops, 0);
+	ber_bvfree(ctx->txnid);
+	ctx->txnid = 0;
+	free(ctx->txnctrls);
+	ctx->txnctrls = 0;
+}
+
+/*
+ * Note an update sent with txn_controls (RC being the return value of
+ * the function that sent it) and end the transaction if it is complete.
+ * Its response is collected later, by txn_collect.
+ */
+static int
+ldapmodify_txn(struct ldapmodify_context *ctx,
+	       char *what, int key, char *dn, int rc, int msgid)
+{
+	LDAP *ld = ctx->ld;
+	LDAPMessage *result;
+	tpending *op;
+
+	if (!ctx->txnid) {
+		/* transaction could not be started */
+		if (!rc) {
+			if (ldap_result(ld, msgid, LDAP_MSG_ONE, 0, &result)
+			    <= 0)
+				ldaperr(ld, "ldap_result");
+			rc = ldap_result2error(ld, result, 1);
+		}
+		return rc ? ldapmodify_error(ctx, what) : 0;
+	}
+
+	op = pending_new(what, 0, key, dn, 0, 0);
+	op->seq = ctx->seq;
+	op->msgid = msgid;
+	ctx->deferred = 1;
+	if (rc) {
+		ldap_perror(ld, what);
+		print_pending_entry(op);
+		journal_record_pending(ctx, op, 0);
+		pending_free(op);
+		txn_collect(ctx);
+		txn_rolled_back(ctx);
+		txn_end(ctx, 0);
+		if (!ctx->continuous)
+			return -1;
+		fputs("(error ignored)\n", stderr);
+		return 0;
+	}
+	g_ptr_array_add(ctx->txnops, op);
+	if (ctx->txnops->len >= ctx->txnsize)
+		txn_end(ctx, 1);
+	return 0;
+}
+
+/*
+ * Coalescing.
+ *
+ * Change records generated by other programs often modify the same entry
+ * several times.  With --coalesce, ldapmodify_change holds modifications
+ * back and merges those of each entry into a single modify operation
+ * with the concatenated LDAPMod lists, which LDAP applies in order, just
+ * as if they had been sent separately.  Modifications of different
+ * entries are independent of each other and can be reordered freely;
+ * adds, deletions, and renames send the held-back modifications first,
+ * so that they are never reordered across them.  Up to COALESCE_MAX
+ * entries are held back at a time.
+ *
+ * Each record keeps its own number in the journal.  If a merged modify
+ * fails, its records are sent again one by one, see records_split.
+ * Updates sent as part of a transaction are not merged.
+ */
+#define COALESCE_MAX 256
+
+typedef struct tmodify {
+	char *key;			/* see dn_key */
+	char *dn;
+	GPtrArray *records;		/* trecord */
+} tmodify;
+
+/*
+ * Return DN in a form that is the same for all its spellings which
+ * differ only in spacing, escaping, or the case of attribute types.
+ * Values are left alone, since their matching rules are not known here.
+ */
+static char *
+dn_key(char *dn)
+{
+	char **rdns = ldap_explode_dn(dn, 0);
+	GString *result = g_string_new("");
+	char *ptr;
+	int i;
+
+	if (!rdns) {
+		g_string_append(result, dn);
+		return g_string_free(result, 0);
+	}
+	for (i = 0; rdns[i]; i++) {
+		int type = 1;
+
+		if (i) g_string_append_c(result, ',');
+		for (ptr = rdns[i]; *ptr; ptr++) {
+			if (*ptr == '\\' && ptr[1]) {
+				g_string_append_len(result, ptr++, 2);
+				continue;
+			}
+			if (*ptr == '=')
+				type = 0;
+			else if (*ptr == '+')
+				type = 1;
+			g_string_append_c(
+				result,
+				type ? tolower((unsigned char) *ptr) : *ptr);
+		}
+	}
+	ldap_value_free(rdns);
+	return g_string_free(result, 0);
+}
+
+/*
+ * Send the modifications held back in M and free it.
  */
-struct ldapmodify_context {
-	LDAP *ld;
-	LDAPControl **controls;
-	int verbose;
-	int noquestions;
-	int continuous;
-};
+static void
+modify_held(struct ldapmodify_context *ctx, tmodify *m)
+{
+	GPtrArray *merged = g_ptr_array_new();
+	trecord *first = g_ptr_array_index(m->records, 0);
+	tchannel *channel;
+	tpending *op;
+	int i, j;
+
+	for (i = 0; i < m->records->len; i++) {
+		trecord *r = g_ptr_array_index(m->records, i);
+		for (j = 0; r->mods[j]; j++)
+			g_ptr_array_add(merged, r->mods[j]);
+	}
+	g_ptr_array_add(merged, 0);
+	op = pending_new("ldap_modify", LDAP_REQ_MODIFY, first->key, m->dn, 0,
+			 (LDAPMod **) merged->pdata);
+	op->records = m->records;
+	g_ptr_array_free(merged, 1);
+	g_free(m->key);
+	free(m->dn);
+	free(m);
+
+	governor_throttle(&ctx->governor);
+	if (ldapmodify_async_p(ctx)) {
+		op->rdns = ldapmodify_reserve(ctx, op->dn, &channel);
+		pending_resend(ctx, channel, op);
+		return;
+	}
+	if (!ldap_modify_ext_s(ctx->ld, op->dn, op->mods, ctx->controls, 0)
+	    || !modify_replacing(ctx, op->dn, op->mods))
+		journal_record_pending(ctx, op, 1);
+	else if (op->records->len > 1)
+		records_split(ctx, op->dn, op->records);
+	else {
+		ldap_perror(ctx->ld, op->what);
+		print_pending_entry(op);
+		fputs("(error ignored)\n", stderr);
+		journal_record_pending(ctx, op, 0);
+	}
+	pending_free(op);
+}
 
-static int
-ldapmodify_error(struct ldapmodify_context *ctx, char *error)
+/*
+ * Send all held-back modifications.
+ */
+static void
+coalesce_flush(struct ldapmodify_context *ctx)
 {
-	ldap_perror(ctx->ld, error);
-	if (!ctx->continuous)
-		return -1;
-	fputs("(error ignored)\n", stderr);
-	return 0;
+	int i;
+
+	if (!ctx->held)
+		return;
+	g_hash_table_remove_all(ctx->held);
+	for (i = 0; i < ctx->order->len; i++)
+		modify_held(ctx, g_ptr_array_index(ctx->order, i));
+	g_ptr_array_set_size(ctx->order, 0);
+}
+
+/*
+ * Hold back MODS of DN as part of the current update.
+ */
+static void
+coalesce_hold(struct ldapmodify_context *ctx,
+	      int key, char *dn, LDAPMod **mods)
+{
+	char *k = dn_key(dn);
+	tmodify *m = g_hash_table_lookup(ctx->held, k);
+	trecord *r = xalloc(sizeof(trecord));
+
+	if (m)
+		g_free(k);
+	else {
+		if (ctx->order->len >= COALESCE_MAX)
+			coalesce_flush(ctx);
+		m = xalloc(sizeof(tmodify));
+		m->key = k;
+		m->dn = xdup(dn);
+		m->records = g_ptr_array_new();
+		g_hash_table_insert(ctx->held, m->key, m);
+		g_ptr_array_add(ctx->order, m);
+	}
+	r->seq = ctx->seq;
+	r->key = key;
+	r->mods = mods_copy(mods);
+	g_ptr_array_add(m->records, r);
+	ctx->deferred = 1;
 }
 
 static int
@@ -164,7 +1624,23 @@ ldapmodify_change(
 	int verbose = ctx->verbose;
 
 	if (verbose) printf("(modify) %s\n", labeldn);
-	if (ldap_modify_ext_s(ld, dn, mods, ctrls, 0))
+	if (ctx->held && !strcmp(labeldn, dn)) {
+		coalesce_hold(ctx, key, dn, mods);
+		return 0;
+	}
+	coalesce_flush(ctx);
+	governor_throttle(&ctx->governor);
+	if (ctx->txnsize) {
+		int msgid;
+		int rc = ldap_modify_ext(
+			ld, dn, mods, txn_controls(ctx), 0, &msgid);
+		return ldapmodify_txn(ctx, "ldap_modify", key, dn, rc, msgid);
+	}
+	if (ldapmodify_async_p(ctx))
+		return ldapmodify_send(
+			ctx, "ldap_modify", LDAP_REQ_MODIFY, key, dn, mods);
+	if (ldap_modify_ext_s(ld, dn, mods, ctrls, 0)
+	    && modify_replacing(ctx, dn, mods))
 		return ldapmodify_error(ctx, "ldap_modify");
 	return 0;
 }
@@ -180,7 +1656,16 @@ ldapmodify_rename(int key, char *dn1, tentry *modified, void *userdata)
 	char *dn2 = entry_dn(modified);
 	int deleteoldrdn = frob_rdn(modified, dn1, FROB_RDN_CHECK) == -1;
 	if (verbose) printf("(rename) %s to %s\n", dn1, dn2);
-	if (moddn(ld, dn1, dn2, deleteoldrdn, ctrls))
+	coalesce_flush(ctx);
+	governor_throttle(&ctx->governor);
+	if (ctx->txnsize) {
+		int msgid;
+		int rc = moddn(ld, dn1, dn2, deleteoldrdn, txn_controls(ctx),
+			       &msgid);
+		return ldapmodify_txn(ctx, "ldap_rename", key, dn1, rc, msgid);
+	}
+	if (ldapmodify_async_p(ctx)) ldapmodify_drain(ctx);
+	if (moddn(ld, dn1, dn2, deleteoldrdn, ctrls, 0))
 		return ldapmodify_error(ctx, "ldap_rename");
 	return 0;
 }
@@ -194,6 +1679,17 @@ ldapmodify_add(int key, char *dn, LDAPMod **mods, void *userdata)
 	int verbose = ctx->verbose;
 
 	if (verbose) printf("(add) %s\n", dn);
+	coalesce_flush(ctx);
+	governor_throttle(&ctx->governor);
+	if (ctx->txnsize) {
+		int msgid;
+		int rc = ldap_add_ext(
+			ld, dn, mods, txn_controls(ctx), 0, &msgid);
+		return ldapmodify_txn(ctx, "ldap_add", key, dn, rc, msgid);
+	}
+	if (ldapmodify_async_p(ctx))
+		return ldapmodify_send(
+			ctx, "ldap_add", LDAP_REQ_ADD, key, dn, mods);
 	if (ldap_add_ext_s(ld, dn, mods, ctrls, 0))
 		return ldapmodify_error(ctx, "ldap_add");
 	return 0;
@@ -208,6 +1704,19 @@ ldapmodify_delete(int key, char *dn, void *userdata)
 	int verbose = ctx->verbose;
 
 	if (verbose) printf("(delete) %s\n", dn);
+	coalesce_flush(ctx);
+	governor_throttle(&ctx->governor);
+	if (ctx->txnsize) {
+		int msgid;
+		int rc = ldap_delete_ext(ld, dn, txn_controls(ctx), 0, &msgid);
+		return ldapmodify_txn(ctx, "ldap_delete", key, dn, rc, msgid);
+	}
+	if (ldapmodify_async_p(ctx)) {
+		if (ctx->noquestions)
+			return ldapmodify_send(
+				ctx, "ldap_delete", LDAP_REQ_DELETE, key, dn, 0);
+		ldapmodify_drain(ctx);
+	}
 	switch (ldap_delete_ext_s(ld, dn, ctrls, 0)) {
 	case 0:
 		break;
@@ -231,12 +1740,174 @@ ldapmodify_rename0(
 	int verbose = ctx->verbose;
 
 	if (verbose) printf("(rename) %s to %s\n", dn1, dn2);
-	if (moddn(ld, dn1, dn2, deleteoldrdn, ctrls))
+	coalesce_flush(ctx);
+	governor_throttle(&ctx->governor);
+	if (ctx->txnsize) {
+		int msgid;
+		int rc = moddn(ld, dn1, dn2, deleteoldrdn, txn_controls(ctx),
+			       &msgid);
+		return ldapmodify_txn(ctx, "ldap_rename", key, dn1, rc, msgid);
+	}
+	if (ldapmodify_async_p(ctx)) ldapmodify_drain(ctx);
+	if (moddn(ld, dn1, dn2, deleteoldrdn, ctrls, 0))
 		return ldapmodify_error(ctx, "ldap_rename");
 	return 0;
 }
 
 
+/*
+ * Journalling wrappers around the ldapmodify handler methods:  Number
+ * each call, skip it if the journal says it was done already, and
+ * journal its outcome unless that is done when the result arrives.
+ */
+static int
+journal_skip(struct ldapmodify_context *ctx)
+{
+	ctx->seq++;
+	ctx->deferred = 0;
+	ctx->failed = 0;
+	return resume_done
+		&& g_hash_table_lookup(resume_done, GINT_TO_POINTER(ctx->seq));
+}
+
+static int
+journal_done(struct ldapmodify_context *ctx, int key, char *dn, int rc)
+{
+	if (rc != -2 && !ctx->deferred)
+		journal_record(ctx, ctx->seq, key, dn, !rc && !ctx->failed);
+	return rc;
+}
+
+static int
+journal_change(
+	int key, char *labeldn, char *dn, LDAPMod **mods, void *userdata)
+{
+	struct ldapmodify_context *ctx = userdata;
+	if (journal_skip(ctx)) return 0;
+	return journal_done(
+		ctx, key, dn,
+		ldapmodify_change(key, labeldn, dn, mods, userdata));
+}
+
+static int
+journal_rename(int key, char *dn1, tentry *modified, void *userdata)
+{
+	struct ldapmodify_context *ctx = userdata;
+	if (journal_skip(ctx)) return 0;
+	return journal_done(
+		ctx, key, dn1, ldapmodify_rename(key, dn1, modified, userdata));
+}
+
+static int
+journal_add(int key, char *dn, LDAPMod **mods, void *userdata)
+{
+	struct ldapmodify_context *ctx = userdata;
+	if (journal_skip(ctx)) return 0;
+	return journal_done(
+		ctx, key, dn, ldapmodify_add(key, dn, mods, userdata));
+}
+
+static int
+journal_delete(int key, char *dn, void *userdata)
+{
+	struct ldapmodify_context *ctx = userdata;
+	if (journal_skip(ctx)) return 0;
+	return journal_done(
+		ctx, key, dn, ldapmodify_delete(key, dn, userdata));
+}
+
+static int
+journal_rename0(
+	int key, char *dn1, char *dn2, int deleteoldrdn, void *userdata)
+{
+	struct ldapmodify_context *ctx = userdata;
+	if (journal_skip(ctx)) return 0;
+	return journal_done(
+		ctx, key, dn1,
+		ldapmodify_rename0(key, dn1, dn2, deleteoldrdn, userdata));
+}
+
+/*
+ * Save what --resume needs besides the clean and data files:  the
+ * syntax used and the offset table, as of the start of the commit.
+ */
+static void
+write_session(char *dir, tparser *p, GArray *offsets)
+{
+	char *name = append(dir, "/session");
+	FILE *s;
+	int n;
+
+	if ( !(s = fopen(name, "w"))) syserr();
+	fprintf(s, "ldapvi-session 1 %s\n",
+		p == &ldif_parser ? "ldif" : "ldapvi");
+	for (n = 0; n < offsets->len; n++)
+		fprintf(s, "%ld\n", g_array_index(offsets, long, n));
+	if (fflush(s) == EOF) syserr();
+	if (fsync(fileno(s)) == -1) syserr();
+	if (fclose(s) == EOF) syserr();
+	free(name);
+}
+
+static GArray *
+read_session(char *dir, tparser **p)
+{
+	char *name = append(dir, "/session");
+	GArray *offsets = g_array_new(0, 0, sizeof(long));
+	char syntax[16];
+	FILE *s;
+	long pos;
+
+	if ( !(s = fopen(name, "r"))) syserr();
+	if (fscanf(s, "ldapvi-session 1 %15s", syntax) != 1)
+		yourfault("Invalid session file.");
+	if (!strcmp(syntax, "ldif"))
+		*p = &ldif_parser;
+	else if (!strcmp(syntax, "ldapvi"))
+		*p = &ldapvi_parser;
+	else
+		yourfault("Invalid session file.");
+	while (fscanf(s, "%ld", &pos) == 1)
+		g_array_append_val(offsets, pos);
+	if (ferror(s)) syserr();
+	if (fclose(s) == EOF) syserr();
+	free(name);
+	return offsets;
+}
+
+/*
+ * Return the set of update numbers listed in the journal.
+ */
+static GHashTable *
+read_journal(char *dir)
+{
+	char *name = append(dir, "/journal");
+	GHashTable *result = g_hash_table_new(g_direct_hash, g_direct_equal);
+	char *line = 0;
+	size_t n = 0;
+	FILE *s;
+
+	if ( !(s = fopen(name, "r"))) {
+		if (errno != ENOENT) syserr();
+		free(name);
+		return result;
+	}
+	while (getline(&line, &n, s) != -1) {
+		char *end;
+		long seq = strtol(line, &end, 10);
+		if (end != line && seq > 0
+		    && (!strncmp(end, " ok ", 4)
+			|| !strncmp(end, " error ", 7)))
+			g_hash_table_insert(
+				result, GINT_TO_POINTER(seq), (void *) 1);
+	}
+	if (ferror(s)) syserr();
+	if (fclose(s) == EOF) syserr();
+	free(line);
+	free(name);
+	return result;
+}
+
 /*****************************************
  * ldif_handler
  */
@@ -573,16 +2244,22 @@ cleanup:
 }
 
 static void
-ensure_tmp_directory(char *dir)
+register_cleanup(char *dir)
 {
-	if (strcmp(dir, "/tmp/ldapvi-XXXXXX")) return;
-	mkdtemp(dir);
 	on_exit((on_exit_function) cleanup, dir);
 	signal(SIGTERM, cleanup_signal);
 	signal(SIGINT, cleanup_signal);
 	signal(SIGPIPE, SIG_IGN);
 }
 
+static void
+ensure_tmp_directory(char *dir)
+{
+	if (strcmp(dir, "/tmp/ldapvi-XXXXXX")) return;
+	mkdtemp(dir);
+	register_cleanup(dir);
+}
+
 static int
 rebind_sasl(LDAP *ld, bind_options *bind_options, char *dir, int verbose)
 {
@@ -745,6 +2422,28 @@ do_connect(char *server, bind_options *bind_options,
 	return ld;
 }
 
+/*
+ * Open an additional connection using the credentials of the (already
+ * bound) main connection, without asking any questions.
+ */
+LDAP *
+connect_quietly(cmdline *cmdline)
+{
+	bind_options bo = cmdline->bind_options;
+	LDAP *ld;
+
+	bo.dialog = BD_NEVER;
+	ld = do_connect(cmdline->server, &bo, cmdline->referrals,
+			cmdline->starttls, cmdline->tls, cmdline->deref,
+			1, 0);
+	if (!ld) {
+		fputs("Error: Failed to open additional connection.\n",
+		      stderr);
+		exit(1);
+	}
+	return ld;
+}
+
 /*
  * fixme: brauchen wir das mit dem user?  dann sollten wir hier noch
  * sasl support vorsehen
@@ -916,28 +2615,165 @@ retry:
 	}
 }
 
+/*
+ * --window, --parallel, --transaction, and --coalesce apply to commits
+ * only with --continue.  Say so once if any of them was given without.
+ */
+static void
+warn_sequential(cmdline *cmdline)
+{
+	static int warned = 0;
+	GString *ignored;
+
+	if (warned)
+		return;
+	warned = 1;
+	ignored = g_string_new("");
+	if (cmdline->window > 1)
+		g_string_append(ignored, " --window");
+	if (cmdline->parallel > 1)
+		g_string_append(ignored, " --parallel");
+	if (cmdline->transaction)
+		g_string_append(ignored, " --transaction");
+	if (cmdline->coalesce)
+		g_string_append(ignored, " --coalesce");
+	if (ignored->len)
+		fprintf(stderr,
+			"Warning: Without --continue, committing updates"
+			" one at a time, ignoring%s.\n",
+			ignored->str);
+	g_string_free(ignored, 1);
+}
+
+/*
+ * Set up CTX for the ldapmodify handler methods.
+ */
+static void
+ldapmodify_init(struct ldapmodify_context *ctx, LDAP *ld,
+		LDAPControl **ctrls, int verbose, int noquestions,
+		int continuous, cmdline *cmdline)
+{
+	int i;
+
+	if (!continuous)
+		warn_sequential(cmdline);
+	ctx->ld = ld;
+	ctx->controls = ctrls;
+	ctx->verbose = verbose;
+	ctx->noquestions = noquestions;
+	ctx->continuous = continuous;
+	ctx->window = cmdline->window;
+	governor_init(&ctx->governor, ctx->window, cmdline->max_rate);
+	ctx->retries = g_ptr_array_new();
+	ctx->nchannels = continuous ? cmdline->parallel : 1;
+	ctx->txnsize = continuous ? cmdline->transaction : 0;
+	ctx->txnid = 0;
+	ctx->txnctrls = 0;
+	ctx->txnops = g_ptr_array_new();
+	if (ctx->txnsize) {
+		static int supported = -1;
+		if (supported == -1)
+			supported = server_supports_extension(
+				ld, LDAP_EXOP_TXN_START);
+		if (!supported) {
+			fputs("Warning: Server does not support transactions,"
+			      " committing updates individually.\n",
+			      stderr);
+			ctx->txnsize = 0;
+		}
+	}
+	ctx->held = continuous && cmdline->coalesce && !ctx->txnsize
+		? g_hash_table_new(g_str_hash, g_str_equal)
+		: 0;
+	ctx->order = g_ptr_array_new();
+	ctx->channels = xalloc(ctx->nchannels * sizeof(tchannel));
+	for (i = 0; i < ctx->nchannels; i++) {
+		ctx->channels[i].ld = i ? connect_quietly(cmdline) : ld;
+		ctx->channels[i].pending
+			= g_hash_table_new(g_direct_hash, g_direct_equal);
+	}
+	ctx->journal = 0;
+	ctx->seq = 0;
+	ctx->unsynced = 0;
+	ctx->last_sync = now_seconds();
+}
+
+/*
+ * Wait for all outstanding updates and release what ldapmodify_init
+ * has set up, except for the journal.
+ */
+static void
+ldapmodify_finish(struct ldapmodify_context *ctx)
+{
+	int i;
+
+	coalesce_flush(ctx);
+	ldapmodify_drain(ctx);
+	if (ctx->verbose && ldapmodify_async_p(ctx))
+		printf("(%d updates in %.1fs, final window %d)\n",
+		       ctx->governor.nresults,
+		       now_seconds() - ctx->governor.start,
+		       (int) ctx->governor.limit);
+	if (ctx->txnid)
+		txn_end(ctx, 1);
+	g_ptr_array_free(ctx->txnops, 1);
+	g_ptr_array_free(ctx->retries, 1);
+	if (ctx->held) g_hash_table_destroy(ctx->held);
+	g_ptr_array_free(ctx->order, 1);
+	for (i = 0; i < ctx->nchannels; i++) {
+		if (i) ldap_unbind_s(ctx->channels[i].ld);
+		g_hash_table_destroy(ctx->channels[i].pending);
+	}
+	free(ctx->channels);
+}
+
 static void
 commit(tparser *p, LDAP *ld, GArray *offsets, char *clean, char *data,
        LDAPControl **ctrls, int verbose, int noquestions, int continuous,
        cmdline *cmdline)
 {
 	struct ldapmodify_context ctx;
+	int rc;
+	char *journal = 0;
 	static thandler ldapmodify_handler = {
-		ldapmodify_change,
-		ldapmodify_rename,
-		ldapmodify_add,
-		ldapmodify_delete,
-		ldapmodify_rename0
+		journal_change,
+		journal_rename,
+		journal_add,
+		journal_delete,
+		journal_rename0
 	};
-	ctx.ld = ld;
-	ctx.controls = ctrls;
-	ctx.verbose = verbose;
-	ctx.noquestions = noquestions;
-	ctx.continuous = continuous;
 
-	switch (compare(p, &ldapmodify_handler, &ctx, offsets, clean, data, 0,
-			cmdline))
-	{
+	ldapmodify_init(&ctx, ld, ctrls, verbose, noquestions, continuous,
+			cmdline);
+	if (session_dir) {
+		journal = append(session_dir, "/journal");
+		if (!resume_done)
+			write_session(session_dir, p, offsets);
+		if ( !(ctx.journal = fopen(journal, resume_done ? "a" : "w")))
+			syserr();
+		keep_session = 1;
+	}
+
+	rc = compare(p, &ldapmodify_handler, &ctx, offsets, clean, data, 0,
+		     cmdline);
+	ldapmodify_finish(&ctx);
+	if (resume_done) {
+		g_hash_table_destroy(resume_done);
+		resume_done = 0;
+	}
+	if (ctx.journal) {
+		journal_sync(&ctx);
+		if (fclose(ctx.journal) == EOF) syserr();
+		if (rc == -2) {
+			/* the data file has been cut, start over */
+			if (unlink(journal) == -1) syserr();
+			write_session(session_dir, p, offsets);
+		}
+		free(journal);
+		keep_session = 0;
+	}
+
+	switch (rc) {
 	case 0:
 		if (!cmdline->quiet)
 			puts("Done.");
@@ -1035,15 +2871,15 @@ entroid_set_entry(LDAP *ld, tentroid *entroid, tentry *entry)
 	int i;
 	tattribute *oc = entry_find_attribute(entry, "objectClass", 0);
 	GPtrArray *values;
+	char **names;
 
 	if (!oc)
 		return 0;
 
-	entroid_reset(entroid);
 	values = attribute_values(oc);
+	names = xalloc((values->len + 1) * sizeof(char *));
 	for (i = 0; i < values->len; i++) {
 		GArray *av = g_ptr_array_index(values, i);
-		LDAPObjectClass *cls;
 
 		{
 			char zero = 0;
@@ -1051,20 +2887,14 @@ entroid_set_entry(LDAP *ld, tentroid *entroid, tentry *entry)
 			g_array_append_val(av, zero);
 			av->len--;
 		}
-
-		cls = entroid_request_class(entroid, av->data);
-		if (!cls) {
-			g_string_append(entroid->comment, "# ");
-			g_string_append(entroid->comment, entroid->error->str);
-			return entroid;
-		}
+		names[i] = av->data;
 	}
 
-	if (compute_entroid(entroid) == -1) {
+	if (entroid_set_classes(entroid, names, values->len) == -1) {
 		g_string_append(entroid->comment, "# ");
 		g_string_append(entroid->comment, entroid->error->str);
-		return entroid;
 	}
+	free(names);
 	return entroid;
 }
 
@@ -1411,6 +3241,154 @@ parse_file(FILE *in,
 	}
 }
 
+/*
+ * Read the next LDIF record from IN into RECORD:  everything up to the
+ * next empty line.  *NLINES counts the lines read so far; *START is set
+ * to the line number of the record's first line.  Return 0 on EOF.
+ */
+static int
+read_record(FILE *in, GString *record, int *nlines, int *start)
+{
+	static char *buf = 0;
+	static size_t n = 0;
+	ssize_t len;
+
+	g_string_truncate(record, 0);
+	while ( (len = getline(&buf, &n, in)) != -1) {
+		(*nlines)++;
+		if (buf[0] == '\n' || (buf[0] == '\r' && buf[1] == '\n')) {
+			if (record->len)
+				break;
+			continue;
+		}
+		if (!record->len)
+			*start = *nlines;
+		g_string_append_len(record, buf, len);
+	}
+	if (len == -1 && ferror(in)) syserr();
+	return record->len != 0;
+}
+
+static FILE *
+record_stream(GString *record)
+{
+	FILE *s;
+#ifdef HAVE_FMEMOPEN
+	if ( (s = fmemopen(record->str, record->len, "r")))
+		return s;
+#endif
+	if ( !(s = tmpfile())) syserr();
+	if (fwrite(record->str, 1, record->len, s) != record->len) syserr();
+	if (fseek(s, 0, SEEK_SET) == -1) syserr();
+	return s;
+}
+
+/*
+ * Return the number of the line, counting from 0, that the parser
+ * reading S from RECORD has stopped in.
+ */
+static int
+record_line(GString *record, FILE *s)
+{
+	long pos = ftell(s);
+	char *ptr = record->str;
+	char *end;
+	int n = 0;
+
+	if (pos <= 0)
+		return 0;
+	/* the last character read is the one at fault */
+	end = record->str + MIN(pos, record->len) - 1;
+	while ( (ptr = memchr(ptr, '\n', end - ptr))) {
+		n++;
+		ptr++;
+	}
+	return n;
+}
+
+/*
+ * --ldapmodify with LDIF input:  Instead of converting all of IN into a
+ * data file and comparing that against an empty clean file, send each
+ * record's changes as soon as it has been read, like ldapmodify(1).
+ * Only one record is kept in memory at a time.  (The ldapvi syntax is
+ * not line-oriented enough for this, since values can span empty lines.)
+ */
+static int
+stream_ldapmodify(LDAP *ld, cmdline *cmdline, GPtrArray *ctrls, FILE *in)
+{
+	struct ldapmodify_context ctx;
+	static thandler ldapmodify_handler = {
+		ldapmodify_change,
+		ldapmodify_rename,
+		ldapmodify_add,
+		ldapmodify_delete,
+		ldapmodify_rename0
+	};
+	tparser *p = &ldif_parser;
+	GString *record = g_string_new("");
+	int nlines = 0;
+	int line = 0;
+	int errline = 0;
+	int rc = 0;
+
+	if (cmdline->in_file) {
+		if ( !(in = fopen(cmdline->in_file, "r"))) syserr();
+	} else if (!in)
+		in = stdin;
+
+	ldapmodify_init(&ctx, ld, (void *) ctrls->pdata, cmdline->verbose,
+			1, cmdline->continuous, cmdline);
+	while (!rc && read_record(in, record, &nlines, &line)) {
+		FILE *s = record_stream(record);
+		char *key = 0;
+		long pos;
+
+		if (p->peek(s, -1, &key, &pos) == -1)
+			rc = -1;
+		else if (!key)
+			;
+		else if (ndecimalp(key)) {
+			/* there is no clean copy to compare against */
+			complain(stderr, "Error: Invalid key: `%s'.\n", key);
+			rc = -1;
+		} else {
+			char *k = key;
+			if (!strcmp(key, "add") && !cmdline->ldapmodify_add)
+				k = "replace";
+			rc = process_immediate(
+				p, &ldapmodify_handler, &ctx, s, pos, k);
+		}
+		if (rc == -1)
+			errline = line + record_line(record, s);
+		if (key) free(key);
+		if (fclose(s) == EOF) syserr();
+	}
+	ldapmodify_finish(&ctx);
+	g_string_free(record, 1);
+	if (cmdline->in_file)
+		if (fclose(in) == EOF) syserr();
+
+	switch (rc) {
+	case 0:
+		if (!cmdline->quiet)
+			puts("Done.");
+		write_ldapvi_history();
+		return 0;
+	case -1:
+		fprintf(stderr,
+			"Syntax error at line %d"
+			" (in record starting at line %d).\n",
+			errline,
+			line);
+		return 1;
+	default:
+		fprintf(stderr,
+			"Error in record starting at line %d, giving up.\n",
+			line);
+		return 1;
+	}
+}
+
 static int
 write_file_header(FILE *s, cmdline *cmdline)
 {
@@ -1566,8 +3544,9 @@ main_write_files(
 		cp("/dev/null", clean, 0, 0);
 		offsets = g_array_new(0, 0, sizeof(long));
 	} else {
+		digests = g_array_new(0, 0, sizeof(tdigest));
 		offsets = search(s, ld, cmdline, (void *) ctrls->pdata, 0,
-				 cmdline->ldif);
+				 cmdline->ldif, digests);
 		if (fclose(s) == EOF) syserr();
 		cp(data, clean, 0, 0);
 	}
@@ -1695,13 +3674,40 @@ main_loop(LDAP *ld, cmdline *cmdline,
 	}
 }
 
+/*
+ * Continue an interrupted commit in DIR, skipping the updates its
+ * journal lists as done.
+ */
+static int
+resume(LDAP *ld, cmdline *cmdline, GPtrArray *ctrls, char *dir)
+{
+	char *clean = append(dir, "/clean");
+	char *data = append(dir, "/data");
+	tparser *parser;
+	GArray *offsets;
+
+	offsets = read_session(dir, &parser);
+	resume_done = read_journal(dir);
+	session_dir = dir;
+	register_cleanup(dir);
+	if (!cmdline->quiet)
+		printf("Resuming commit, %d updates done already.\n",
+		       g_hash_table_size(resume_done));
+	commit(parser, ld, offsets, clean, data, (void *) ctrls->pdata,
+	       cmdline->verbose, 1, cmdline->continuous, cmdline);
+	fputs("Error while resuming, giving up.\n", stderr);
+	keep_session = 1;
+	return 1;
+}
+
 int
 main(int argc, const char **argv)
 {
 	LDAP *ld;
 	cmdline cmdline;
 	GPtrArray *ctrls = g_ptr_array_new();
-	static char dir[] = "/tmp/ldapvi-XXXXXX";
+	static char tmpdir[] = "/tmp/ldapvi-XXXXXX";
+	char *dir = tmpdir;
 	char *clean;
 	char *data;
 	char *sasl;
@@ -1737,6 +3743,8 @@ main(int argc, const char **argv)
 	else
 		parser = &ldapvi_parser;
 	read_ldapvi_history();
+	if (cmdline.resume)
+		dir = cmdline.resume;
 
 	setupterm(0, 1, 0);
 	ld = do_connect(cmdline.server,
@@ -1756,6 +3764,9 @@ main(int argc, const char **argv)
 		append_sort_control(ld, ctrls, cmdline.sortkeys);
 	g_ptr_array_add(ctrls, 0);
 
+	if (cmdline.resume)
+		return resume(ld, &cmdline, ctrls, dir);
+
 	if (cmdline.discover) {
 		if (cmdline.basedns->len > 0)
 			yourfault("Conflicting options given:"
@@ -1779,12 +3790,19 @@ main(int argc, const char **argv)
 		search(target_stream, ld, &cmdline, (void *) ctrls->pdata, 1,
 		       cmdline.mode == ldapvi_mode_out
 		       ? !cmdline.ldapvi
-		       : cmdline.ldif);
+		       : cmdline.ldif,
+		       0);
 		write_ldapvi_history();
 		exit(0);
 	}
 
+	if (cmdline.mode == ldapvi_mode_in
+	    && cmdline.noninteractive
+	    && !cmdline.ldapvi)
+		return stream_ldapmodify(ld, &cmdline, ctrls, source_stream);
+
 	ensure_tmp_directory(dir);
+	session_dir = dir;
 	clean = append(dir, "/clean");
 	data = append(dir, "/data");
 	sasl = append(dir, "/sasl");
@@ -43,6 +43,19 @@ carray_ptr_cmp(const void *aa, const void *bb)
 	return carray_cmp(a ,b);
 }
 
+guint
+carray_hash(gconstpointer p)
+{
+	GArray *a = (GArray *) p;
+	return fnv_hash(FNV_BASIS, a->data, a->len);
+}
+
+gboolean
+carray_equal(gconstpointer p, gconstpointer q)
+{
+	return !carray_cmp((GArray *) p, (GArray *) q);
+}
+
 void
 fdcp(int fdsrc, int fddst)
 {
@@ -432,6 +445,21 @@ adjoin_str(GPtrArray *strs, char *str)
 	return i;
 }
 
+/*
+ * 64 bit FNV-1a hash of the N bytes at PTR, continuing from H.  Start
+ * with FNV_BASIS.
+ */
+guint64
+fnv_hash(guint64 h, char *ptr, long n)
+{
+	unsigned char *p = (unsigned char *) ptr;
+	unsigned char *end = p + n;
+
+	while (p < end)
+		h = (h ^ *p++) * 1099511628211ULL;
+	return h;
+}
+
 int
 adjoin_ptr(GPtrArray *a, void *p)
 {
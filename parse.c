@@ -16,88 +16,72 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
  * 02110-1301 USA.
  */
-#define _XOPEN_SOURCE
+#define _GNU_SOURCE
 #include <unistd.h>
 #include "common.h"
-
-#define fast_g_string_append_c(gstring, c)				\
-	do {								\
-		if ((gstring)->len + 1 >= (gstring)->allocated_len)	\
-			g_string_append_c((gstring), (c));		\
-		else {							\
-			(gstring)->str[(gstring)->len++] = (c);		\
-			(gstring)->str[(gstring)->len] = 0;		\
-		}							\
-	} while (0)
+#include "config.h"
+#ifdef HAVE_CRYPT_H
+#include <crypt.h>
+#endif
 
 static int
 read_lhs(FILE *s, GString *lhs)
 {
-	int c;
-
-	for (;;) {
-		switch ( c = getc_unlocked(s)) {
-		case ' ':
-			if (ferror(s)) syserr();
-			return 0;
-		case EOF:
-			fputs("Error: Unexpected EOF.\n", stderr);
-			return -1;
-		case '\n':
-			fputs("Error: Unexpected EOL.\n", stderr);
-			return -1;
-		case 0:
-			fputs("Error: Null byte not allowed.\n", stderr);
-			return -1;
-		default:
-			fast_g_string_append_c(lhs, c);
-		}
+	char *line;
+	long n = scan_until(s, ' ', &line);
+	char *stop = scan_any(line, n, "\n", 2);
+
+	if (stop) {
+		scan_unread(s, n - (stop - line) - 1);
+		if (*stop)
+			complain(stderr, "Error: Unexpected EOL.\n");
+		else
+			complain(stderr, "Error: Null byte not allowed.\n");
+		return -1;
+	}
+	if (!n || line[n - 1] != ' ') {
+		complain(stderr, "Error: Unexpected EOF.\n");
+		return -1;
 	}
+	g_string_append_len(lhs, line, n - 1);
+	return 0;
 }
 
 static int
 read_backslashed(FILE *s, GString *data)
 {
-	int c;
-
 	for (;;) {
-		switch ( c = getc_unlocked(s)) {
-		case '\n':
-			if (ferror(s)) syserr();
-			return 0;
-		case EOF:
-			goto error;
-		case '\\':
-			if ( (c = fgetc(s)) == EOF) goto error;
-			/* fall through */
-		default:
-			fast_g_string_append_c(data, c);
+		char *line;
+		long n = scan_until(s, '\n', &line);
+		char *ptr = line;
+		char *end = line + n;
+		char *bs;
+
+		while ( (bs = memchr(ptr, '\\', end - ptr))) {
+			g_string_append_len(data, ptr, bs - ptr);
+			if (bs + 1 == end) goto error;
+			g_string_append_c(data, bs[1]);
+			ptr = bs + 2;
+		}
+		if (ptr == end) {
+			/* escaped newline, or end of file */
+			if (!n) goto error;
+			continue;
 		}
+		if (end[-1] != '\n') goto error;
+		g_string_append_len(data, ptr, end - ptr - 1);
+		return 0;
 	}
 
 error:
-	fputs("Error: Unexpected EOF.\n", stderr);
+	complain(stderr, "Error: Unexpected EOF.\n");
 	return -1;
 }
 
 static int
 read_ldif_attrval(FILE *s, GString *data)
 {
-	int c;
-
-	for (;;)
-		switch ( c = getc_unlocked(s)) {
-		case '\n':
-			if ( (c = fgetc(s)) == ' ') /* folded line */ break;
-			ungetc(c, s);
-			if (ferror(s)) syserr();
-			return 0;
-		case EOF:
-			fputs("Error: Unexpected EOF.\n", stderr);
-			return -1;
-		default:
-			fast_g_string_append_c(data, c);
-		}
+	return scan_folded(s, data, 0);
 }
 
 static int
@@ -123,49 +107,67 @@ read_from_file(GString *data, char *name)
 static int
 skip_comment(FILE *s)
 {
-	int c;
-
-	for (;;)
-		switch ( c = fgetc(s)) {
-		case EOF:
-			fputs("Error: Unexpected EOF.\n", stderr);
-			return -1;
-		case '\n':
-			if ( (c = fgetc(s)) == ' ') /* folded line */ break;
-			ungetc(c, s);
-			if (ferror(s)) syserr();
-			return 0;
-		}
+	return scan_folded(s, 0, 0);
 }
 
 static char *saltbag
 	= "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz1234567890./";
 
+/*
+ * Return crypt(KEY, SALT) as a newly allocated string, or 0.  Plain
+ * crypt() keeps its result in static storage, and diff.c parses in
+ * several threads at once.
+ */
+static char *
+crypt_copy(char *key, char *salt)
+{
+	char *result;
+#ifdef HAVE_CRYPT_R
+	struct crypt_data *data = xalloc(sizeof(struct crypt_data));
+
+	data->initialized = 0;
+	result = crypt_r(key, salt, data);
+	result = result ? xdup(result) : 0;
+	free(data);
+#else
+	static GMutex mutex;
+
+	g_mutex_lock(&mutex);
+	result = crypt(key, salt);
+	result = result ? xdup(result) : 0;
+	g_mutex_unlock(&mutex);
+#endif
+	return result;
+}
+
 static char *
 cryptdes(char *key)
 {
-	unsigned char salt[2];
+	char salt[3];
 	int fd = open("/dev/random", 2);
 	if (fd == -1) {
-		puts("Sorry, crypt not available: Cannot open /dev/random.");
+		complain(stderr, "Sorry, crypt not available:"
+			 " Cannot open /dev/random.\n");
 		return 0;
 	}
 	if (read(fd, salt, 2) != 2) syserr();
 	close(fd);
 	salt[0] = saltbag[salt[0] & 63];
 	salt[1] = saltbag[salt[1] & 63];
-	return crypt(key, (char *) salt);
+	salt[2] = 0;
+	return crypt_copy(key, salt);
 }
 
 static char *
 cryptmd5(char *key)
 {
 	char *result;
-	unsigned char salt[11];
+	unsigned char salt[12];
 	int i;
 	int fd = open("/dev/random", 2);
 	if (fd == -1) {
-		puts("Sorry, MD5 not available: Cannot open /dev/random.");
+		complain(stderr, "Sorry, MD5 not available:"
+			 " Cannot open /dev/random.\n");
 		return 0;
 	}
 	salt[0] = '$';
@@ -175,9 +177,12 @@ cryptmd5(char *key)
 	close(fd);
 	for (i = 3; i < 11; i++)
 		salt[i] = saltbag[salt[i] & 63];
-	result = crypt(key, (char *) salt);
+	salt[11] = 0;
+	result = crypt_copy(key, (char *) salt);
 	if (!result || strlen(result) < 25) {
-		puts("Sorry, MD5 not available: Are you using the glibc?");
+		complain(stderr, "Sorry, MD5 not available:"
+			 " Are you using the glibc?\n");
+		if (result) free(result);
 		return 0;
 	}
 	return result;
@@ -237,14 +242,14 @@ read_line1(FILE *s, GString *name, GString *value)
 		if (read_ldif_attrval(s, value) == -1) return -1;
 		ustr = (unsigned char *) value->str;;
 		if ( (len = read_base64(value->str, ustr, value->len)) == -1) {
-			fputs("Error: Invalid Base64 string.\n", stderr);
+			complain(stderr, "Error: Invalid Base64 string.\n");
 			return -1;
 		}
 		value->len = len;
 	} else if (!strcmp(encoding, "<")) {
 		if (read_ldif_attrval(s, value) == -1) return -1;
 		if (strncmp(value->str, "file://", 7)) {
-			fputs("Error: Unknown URL scheme.\n", stderr);
+			complain(stderr, "Error: Unknown URL scheme.\n");
 			return -1;
 		}
 		if (read_from_file(value, value->str + 7) == -1)
@@ -255,12 +260,14 @@ read_line1(FILE *s, GString *name, GString *value)
 		if ( !(hash = cryptdes(value->str))) return -1;
 		g_string_assign(value, "{CRYPT}");
 		g_string_append(value, hash);
+		free(hash);
 	} else if (!strcasecmp(encoding, "cryptmd5")) {
 		char *hash;
 		if (read_ldif_attrval(s, value) == -1) return -1;
 		if ( !(hash = cryptmd5(value->str))) return -1;
 		g_string_assign(value, "{CRYPT}");
 		g_string_append(value, hash);
+		free(hash);
 	} else if (!strcasecmp(encoding, "sha")) {
 		if (read_ldif_attrval(s, value) == -1) return -1;
 		g_string_assign(value, "{SHA}");
@@ -281,7 +288,7 @@ read_line1(FILE *s, GString *name, GString *value)
 		char *ptr;
 		int n = strtol(encoding, &ptr, 10);
 		if (*ptr) {
-			fputs("Error: Unknown value encoding.\n", stderr);
+			complain(stderr, "Error: Unknown value encoding.\n");
 			return -1;
 		}
 		g_string_set_size(value, n);
@@ -312,7 +319,7 @@ read_line(FILE *s, GString *name, GString *value)
 		return -1;
 	case 0:
 		if (!name->len) {
-			fputs("Error: Space at beginning of line.\n", stderr);
+			complain(stderr, "Error: Space at beginning of line.\n");
 			return -1;
 		}
 		return 0;
@@ -329,13 +336,13 @@ read_rename_body(FILE *s, GString *tmp1, GString *tmp2, int *deleteoldrdn)
 	if (read_line(s, tmp1, tmp2) == -1)
 		return 0;
 	if (!tmp1->len) {
-		fputs("Error: Rename record lacks dn line.\n", stderr);
+		complain(stderr, "Error: Rename record lacks dn line.\n");
 		return 0;
 	}
 	*deleteoldrdn = !strcmp(tmp1->str, "replace");
 	if (!*deleteoldrdn && strcmp(tmp1->str, "add")) {
-		fputs("Error: Expected 'add' or 'replace' in rename record.\n",
-		      stderr);
+		complain(stderr,
+			 "Error: Expected 'add' or 'replace' in rename record.\n");
 		return 0;
 	}
 	dn = xdup(tmp2->str);
@@ -345,7 +352,7 @@ read_rename_body(FILE *s, GString *tmp1, GString *tmp2, int *deleteoldrdn)
 	}
 	if (tmp1->len) {
 		free(dn);
-		fputs("Error: Garbage at end of rename record.\n", stderr);
+		complain(stderr, "Error: Garbage at end of rename record.\n");
 		return 0;
 	}
 	return dn;
@@ -357,7 +364,7 @@ read_nothing(FILE *s, GString *tmp1, GString *tmp2)
 	if (read_line(s, tmp1, tmp2) == -1)
 		return -1;
 	if (tmp1->len) {
-		fputs("Error: Garbage at end of record.\n", stderr);
+		complain(stderr, "Error: Garbage at end of record.\n");
 		return -1;
 	}
 	return 0;
@@ -376,7 +383,7 @@ ldapmod4line(char *action, char *ad)
 	else if (!strcmp(action, "replace"))
 		op = LDAP_MOD_REPLACE;
 	else {
-		fputs("Error: Invalid change marker.\n", stderr);
+		complain(stderr, "Error: Invalid change marker.\n");
 		return 0;
 	}
 
@@ -471,7 +478,7 @@ read_header(GString *tmp1, GString *tmp2,
 		}
 		if (!strcmp(tmp1->str, "version")) {
 			if (strcmp(tmp2->str, "ldapvi")) {
-				fputs("Error: Invalid file format.\n", stderr);
+				complain(stderr, "Error: Invalid file format.\n");
 				return -1;
 			}
 			tmp1->len = 0;
@@ -480,7 +487,7 @@ read_header(GString *tmp1, GString *tmp2,
 
 	rdns = ldap_explode_dn(tmp2->str, 0);
 	if (!rdns) {
-		fputs("Error: Invalid distinguished name string.\n", stderr);
+		complain(stderr, "Error: Invalid distinguished name string.\n");
 		return -1;
 	}
 
@@ -727,7 +734,7 @@ read_profile_header(GString *tmp1, GString *tmp2, FILE *s, char **name)
 	} while (!tmp1->len);
 
 	if (strcmp(tmp1->str, "profile")) {
-		fprintf(stderr,
+		complain(stderr,
 			"Error: Expected 'profile' in configuration,"
 			" found '%s' instead.\n",
 			tmp1->str);
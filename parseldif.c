@@ -20,16 +20,6 @@
 #include <unistd.h>
 #include "common.h"
 
-#define fast_g_string_append_c(gstring, c)				\
-	do {								\
-		if ((gstring)->len + 1 >= (gstring)->allocated_len)	\
-			g_string_append_c((gstring), (c));		\
-		else {							\
-			(gstring)->str[(gstring)->len++] = (c);		\
-			(gstring)->str[(gstring)->len] = 0;		\
-		}							\
-	} while (0)
-
 /*
  * 0: ok
  * -1: parse error
@@ -41,12 +31,23 @@ ldif_read_ad(FILE *s, GString *lhs)
 	int c;
 
 	for (;;) {
-		switch ( c = getc_unlocked(s)) {
-		case ':':
-			if (ferror(s)) syserr();
+		char *line;
+		long n = scan_until(s, ':', &line);
+		char *stop = scan_any(line, n, "\n\r", 3);
+
+		if (!stop) {
+			if (!n || line[n - 1] != ':') {
+				complain(stderr, "Error: Unexpected EOF.\n");
+				return -1;
+			}
+			g_string_append_len(lhs, line, n - 1);
 			return 0;
-		case EOF:
-			fputs("Error: Unexpected EOF.\n", stderr);
+		}
+		g_string_append_len(lhs, line, stop - line);
+		scan_unread(s, n - (stop - line) - 1);
+		switch (*stop) {
+		case 0:
+			complain(stderr, "Error: Null byte not allowed.\n");
 			return -1;
 		case '\r':
 			if (fgetc(s) != '\n')
@@ -56,18 +57,13 @@ ldif_read_ad(FILE *s, GString *lhs)
 			if (lhs->len) {
 				if ( (c = fgetc(s)) == ' ')
 					/* folded line */
-					break;
+					continue;
 				ungetc(c, s);
 				if (lhs->len == 1 && lhs->str[0] == '-')
 					return -2;
 			}
-			fputs("Error: Unexpected EOL.\n", stderr);
-			return -1;
-		case 0:
-			fputs("Error: Null byte not allowed.\n", stderr);
+			complain(stderr, "Error: Unexpected EOL.\n");
 			return -1;
-		default:
-			fast_g_string_append_c(lhs, c);
 		}
 	}
 }
@@ -85,7 +81,7 @@ ldif_read_encoding(FILE *s)
 		case '<':
 			return c;
 		case EOF:
-			fputs("Error: Unexpected EOF.\n", stderr);
+			complain(stderr, "Error: Unexpected EOF.\n");
 			return -1;
 		case '\r':
 			if (fgetc(s) != '\n')
@@ -96,7 +92,7 @@ ldif_read_encoding(FILE *s)
 			ungetc(c, s);
 			return '\n';
 		case 0:
-			fputs("Error: Null byte not allowed.\n", stderr);
+			complain(stderr, "Error: Null byte not allowed.\n");
 			return -1;
 		default:
 			ungetc(c, s);
@@ -108,25 +104,7 @@ ldif_read_encoding(FILE *s)
 static int
 ldif_read_safe(FILE *s, GString *data)
 {
-	int c;
-
-	for (;;)
-		switch ( c = getc_unlocked(s)) {
-		case '\r':
-			if (fgetc(s) != '\n')
-				return -1;
-			/* fall through */
-		case '\n':
-			if ( (c = fgetc(s)) == ' ') /* folded line */ break;
-			ungetc(c, s);
-			if (ferror(s)) syserr();
-			return 0;
-		case EOF:
-			fputs("Error: Unexpected EOF.\n", stderr);
-			return -1;
-		default:
-			fast_g_string_append_c(data, c);
-		}
+	return scan_folded(s, data, 1);
 }
 
 static int
@@ -152,23 +130,7 @@ ldif_read_from_file(GString *data, char *name)
 static int
 ldif_skip_comment(FILE *s)
 {
-	int c;
-
-	for (;;)
-		switch ( c = fgetc(s)) {
-		case EOF:
-			fputs("Error: Unexpected EOF.\n", stderr);
-			return -1;
-		case '\r':
-			if (fgetc(s) != '\n')
-				return -1;
-			/* fall through */
-		case '\n':
-			if ( (c = fgetc(s)) == ' ') /* folded line */ break;
-			ungetc(c, s);
-			if (ferror(s)) syserr();
-			return 0;
-		}
+	return scan_folded(s, 0, 1);
 }
 
 /*
@@ -226,7 +188,7 @@ ldif_read_line1(FILE *s, GString *name, GString *value)
 		if (ldif_read_safe(s, value) == -1) return -1;
 		ustr = (unsigned char *) value->str;;
 		if ( (len = read_base64(value->str, ustr, value->len)) == -1) {
-			fputs("Error: Invalid Base64 string.\n", stderr);
+			complain(stderr, "Error: Invalid Base64 string.\n");
 			return -1;
 		}
 		value->len = len;
@@ -234,7 +196,7 @@ ldif_read_line1(FILE *s, GString *name, GString *value)
 	case '<':
 		if (ldif_read_safe(s, value) == -1) return -1;
 		if (strncmp(value->str, "file://", 7)) {
-			fputs("Error: Unknown URL scheme.\n", stderr);
+			complain(stderr, "Error: Unknown URL scheme.\n");
 			return -1;
 		}
 		if (ldif_read_from_file(value, value->str + 7) == -1)
@@ -259,7 +221,7 @@ ldif_read_line(FILE *s, GString *name, GString *value)
 {
 	int rc = ldif_read_line1(s, name, value);
 	if (rc == -2) {
-		fputs("Error: Unexpected EOL.\n", stderr);
+		complain(stderr, "Error: Unexpected EOL.\n");
 		rc = -1;
 	}
 	return rc;
@@ -277,7 +239,7 @@ ldif_read_rename_body(FILE *s,
 
 	if (ldif_read_line(s, tmp1, tmp2) == -1) return 0;
 	if (strcmp(tmp1->str, "newrdn")) {
-		fputs("Error: Expected 'newrdn'.\n", stderr);
+		complain(stderr, "Error: Expected 'newrdn'.\n");
 		return 0;
 	}
 	i = tmp2->len;
@@ -288,7 +250,7 @@ ldif_read_rename_body(FILE *s,
 		return 0;
 	}
 	if (strcmp(tmp1->str, "deleteoldrdn")) {
-		fputs("Error: Expected 'deleteoldrdn'.\n", stderr);
+		complain(stderr, "Error: Expected 'deleteoldrdn'.\n");
 		free(newrdn);
 		return 0;
 	}
@@ -297,8 +259,8 @@ ldif_read_rename_body(FILE *s,
 	else if (!strcmp(tmp2->str, "1"))
 		*deleteoldrdn = 1;
 	else {
-		fputs("Error: Expected '0' or '1' for 'deleteoldrdn'.\n",
-		      stderr);
+		complain(stderr,
+			 "Error: Expected '0' or '1' for 'deleteoldrdn'.\n");
 		free(newrdn);
 		return 0;
 	}
@@ -319,7 +281,7 @@ ldif_read_rename_body(FILE *s,
 	}
 	if (strcmp(tmp1->str, "newsuperior")) {
 		free(newrdn);
-		fputs("Error: Garbage at end of moddn record.\n", stderr);
+		complain(stderr, "Error: Garbage at end of moddn record.\n");
 		return 0;
 	}
 	if (tmp2->len == 0)
@@ -339,7 +301,7 @@ ldif_read_nothing(FILE *s, GString *tmp1, GString *tmp2)
 	if (ldif_read_line(s, tmp1, tmp2) == -1)
 		return -1;
 	if (tmp1->len) {
-		fputs("Error: Garbage at end of record.\n", stderr);
+		complain(stderr, "Error: Garbage at end of record.\n");
 		return -1;
 	}
 	return 0;
@@ -358,8 +320,8 @@ ldif_ldapmod4line(char *action, char *ad)
 	else if (!strcmp(action, "replace"))
 		op = LDAP_MOD_REPLACE;
 	else {
-		fputs(action, stderr);
-		fputs("Error: Invalid change marker.\n", stderr);
+		complain(stderr, "%s", action);
+		complain(stderr, "Error: Invalid change marker.\n");
 		return 0;
 	}
 
@@ -399,9 +361,9 @@ ldif_read_modify_body(FILE *s, GString *tmp1, GString *tmp2)
 			switch ( rc = ldif_read_line1(s, tmp1, tmp2)) {
 			case 0:
 				if (strcmp(tmp1->str, m->mod_type)) {
-					fputs("Error: Attribute name mismatch"
-					      " in change-modify.",
-					      stderr);
+					complain(stderr,
+						 "Error: Attribute name mismatch"
+						 " in change-modify.");
 					goto error;
 				}
 				g_ptr_array_add(values, gstring2berval(tmp2));
@@ -476,7 +438,7 @@ ldif_read_header(GString *tmp1, GString *tmp2,
 		}
 		if (!strcmp(tmp1->str, "version")) {
 			if (strcmp(tmp2->str, "1")) {
-				fputs("Error: Invalid file format.\n", stderr);
+				complain(stderr, "Error: Invalid file format.\n");
 				return -1;
 			}
 			tmp1->len = 0;
@@ -485,7 +447,7 @@ ldif_read_header(GString *tmp1, GString *tmp2,
 
 	rdns = ldap_explode_dn(tmp2->str, 0);
 	if (!rdns) {
-		fputs("Error: Invalid distinguished name string.\n", stderr);
+		complain(stderr, "Error: Invalid distinguished name string.\n");
 		return -1;
 	}
 	if (dn)
@@ -509,12 +471,12 @@ ldif_read_header(GString *tmp1, GString *tmp2,
 			 || !strcmp(tmp2->str, "add"))
 			k = tmp2->str;
 		else {
-			fputs("Error: invalid changetype.\n", stderr);
+			complain(stderr, "Error: invalid changetype.\n");
 			if (dn) free(d);
 			return -1;
 		}
 	} else if (!strcmp(tmp1->str, "control")) {
-		fputs("Error: Sorry, 'control:' not supported.\n", stderr);
+		complain(stderr, "Error: Sorry, 'control:' not supported.\n");
 		if (dn) free(d);
 		return -1;
 	} else {
@@ -107,6 +107,7 @@ on_exit(void (*function)(int, void *), void *arg)
 
 void g_string_append_base64(
 	GString *string, unsigned char const *src, size_t srclength);
+void complain(FILE *s, char *fmt, ...);
 
 int
 g_string_append_sha(GString *string, char *key)
@@ -117,7 +118,7 @@ g_string_append_sha(GString *string, char *key)
 	g_string_append_base64(string, tmp, sizeof(tmp));
 	return 1;
 #else
-	puts("Sorry, SHA1 support not linked into ldapvi.");
+	complain(stderr, "Sorry, SHA1 support not linked into ldapvi.\n");
 	return 0;
 #endif
 }
@@ -141,7 +142,7 @@ g_string_append_ssha(GString *string, char *key)
 	g_string_append_base64(string, tmp, sizeof(tmp));
 	return 1;
 #else
-	puts("Sorry, SHA1 support not linked into ldapvi.");
+	complain(stderr, "Sorry, SHA1 support not linked into ldapvi.\n");
 	return 0;
 #endif
 }
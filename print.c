@@ -20,16 +20,136 @@
 
 t_print_binary_mode print_binary_mode = PRINT_UTF8;
 
+/*
+ * Output is formatted into a memory buffer and handed to stdio in large
+ * blocks, so that the printers below never call stdio per character and
+ * check for errors only once per block.
+ */
+#define WRITER_BUFFER_SIZE (256 * 1024)
+
+twriter *
+writer_new(FILE *s)
+{
+	twriter *w = xalloc(sizeof(twriter));
+	w->s = s;
+	w->buf = g_string_sized_new(WRITER_BUFFER_SIZE + 4096);
+	w->pos = ftell(s);
+	w->hashing = 0;
+	return w;
+}
+
+/*
+ * The position in the stream at which the next byte written will end up,
+ * or -1 if the stream is not seekable.
+ */
+long
+writer_tell(twriter *w)
+{
+	return w->pos == -1 ? -1 : w->pos + w->buf->len;
+}
+
+/*
+ * Hash the buffered output up to stream position END.
+ */
 static void
-write_backslashed(FILE *s, char *ptr, int n)
+writer_fold(twriter *w, long end)
 {
-	int i;
-	for (i = 0; i < n; i++) {
-		char c = ptr[i];
-		if (c == '\n' || c == '\\') fputc('\\', s);
-		fputc(c, s);
+	w->hash = fnv_hash(w->hash,
+			   w->buf->str + (w->hashed - w->pos),
+			   end - w->hashed);
+	w->hashed = end;
+}
+
+void
+writer_flush(twriter *w)
+{
+	if (!w->buf->len)
+		return;
+	if (w->hashing)
+		writer_fold(w, w->pos + w->buf->len);
+	if (fwrite(w->buf->str, 1, w->buf->len, w->s) != w->buf->len
+	    || fflush(w->s) == EOF)
+		syserr();
+	if (w->pos != -1)
+		w->pos += w->buf->len;
+	g_string_truncate(w->buf, 0);
+}
+
+/*
+ * Start hashing the output from stream position START on, which must
+ * lie in the unflushed part of the buffer, if the stream is seekable.
+ * Each call to writer_digest() then returns the hash of the output
+ * since the previous one (or since START).
+ */
+void
+writer_start_digests(twriter *w, long start)
+{
+	if (w->pos == -1)
+		return;
+	w->hashing = 1;
+	w->hashed = start;
+	w->hash = FNV_BASIS;
+}
+
+/*
+ * Return the hash of the output written between the previous digest
+ * and stream position END, which must lie in the unflushed part of the
+ * buffer.
+ */
+guint64
+writer_digest(twriter *w, long end)
+{
+	guint64 result;
+
+	writer_fold(w, end);
+	result = w->hash;
+	w->hash = FNV_BASIS;
+	return result;
+}
+
+/*
+ * Flush if enough output has accumulated.  Call this between records.
+ */
+void
+writer_commit(twriter *w)
+{
+	if (w->buf->len >= WRITER_BUFFER_SIZE)
+		writer_flush(w);
+}
+
+void
+writer_free(twriter *w)
+{
+	writer_flush(w);
+	g_string_free(w->buf, 1);
+	free(w);
+}
+
+/*
+ * Write OUT to S in one go and free it.
+ */
+static void
+print_out(FILE *s, GString *out)
+{
+	if (fwrite(out->str, 1, out->len, s) != out->len) syserr();
+	g_string_free(out, 1);
+}
+
+static void
+write_backslashed(GString *out, char *ptr, int n)
+{
+	char *end = ptr + n;
+
+	while (ptr < end) {
+		char *run = ptr;
+		while (ptr < end && *ptr != '\n' && *ptr != '\\')
+			ptr++;
+		g_string_append_len(out, run, ptr - run);
+		if (ptr < end) {
+			g_string_append_c(out, '\\');
+			g_string_append_c(out, *ptr++);
+		}
 	}
-	if (ferror(s)) syserr();
 }
 
 static int
@@ -126,7 +246,7 @@ safe_string_p(char *str, int n)
 }
 
 static void
-print_attrval(FILE *s, char *str, int len, int prefernocolon)
+print_attrval(GString *out, char *str, int len, int prefernocolon)
 {
 	int readablep;
 	switch (print_binary_mode) {
@@ -144,120 +264,136 @@ print_attrval(FILE *s, char *str, int len, int prefernocolon)
 	}
 
 	if (!readablep) {
-		fputs(":: ", s);
-		print_base64((unsigned char *) str, len, s);
+		g_string_append_len(out, ":: ", 3);
+		g_string_append_base64(out, (unsigned char *) str, len);
 	} else if (prefernocolon) {
-		fputc(' ', s);
-		write_backslashed(s, str, len);
+		g_string_append_c(out, ' ');
+		write_backslashed(out, str, len);
 	} else if (!safe_string_p(str, len)) {
-		fputs(":; ", s);
-		write_backslashed(s, str, len);
+		g_string_append_len(out, ":; ", 3);
+		write_backslashed(out, str, len);
 	} else {
-		fputs(": ", s);
-		fwrite(str, 1, len, s);
+		g_string_append_len(out, ": ", 2);
+		g_string_append_len(out, str, len);
 	}
 }
 
 static void
-print_attribute(FILE *s, tattribute *attribute)
+print_attribute(GString *out, tattribute *attribute)
 {
 	GPtrArray *values = attribute_values(attribute);
+	char *ad = attribute_ad(attribute);
 	int j;
 
 	for (j = 0; j < values->len; j++) {
 		GArray *av = g_ptr_array_index(values, j);
-		fputs(attribute_ad(attribute), s);
-		print_attrval(s, av->data, av->len, 0);
-		fputc('\n', s);
+		g_string_append(out, ad);
+		print_attrval(out, av->data, av->len, 0);
+		g_string_append_c(out, '\n');
 	}
-	if (ferror(s)) syserr();
 }
 
 static void
-print_entroid_bottom(FILE *s, tentroid *entroid)
+print_entroid_bottom(GString *out, tentroid *entroid)
 {
 	int i;
 	LDAPAttributeType *at;
 	for (i = 0; i < entroid->must->len; i++) {
 		at = g_ptr_array_index(entroid->must, i);
-		fprintf(s, "# required attribute not shown: %s\n",
-			attributetype_name(at));
+		if (entroid_seen(entroid, at))
+			continue;
+		g_string_append(out, "# required attribute not shown: ");
+		g_string_append(out, attributetype_name(at));
+		g_string_append_c(out, '\n');
 	}
 	for (i = 0; i < entroid->may->len; i++) {
 		at = g_ptr_array_index(entroid->may, i);
-		fprintf(s, "#%s: \n", attributetype_name(at));
+		if (entroid_seen(entroid, at))
+			continue;
+		g_string_append_c(out, '#');
+		g_string_append(out, attributetype_name(at));
+		g_string_append(out, ": \n");
 	}
 }
 
+static void
+print_schema_warning(GString *out, char *ad)
+{
+	g_string_append(out, "# WARNING: ");
+	g_string_append(out, ad);
+	g_string_append(out, " not allowed by schema\n");
+}
+
 void
 print_ldapvi_entry(FILE *s, tentry *entry, char *key, tentroid *entroid)
 {
 	GPtrArray *attributes = entry_attributes(entry);
+	GString *out = g_string_new("\n");
 	int i;
 
-	fputc('\n', s);
-	fputs(key ? key : "entry", s);
-	fputc(' ', s);
-	fputs(entry_dn(entry), s);
-	fputc('\n', s);
-	if (ferror(s)) syserr();
+	g_string_append(out, key ? key : "entry");
+	g_string_append_c(out, ' ');
+	g_string_append(out, entry_dn(entry));
+	g_string_append_c(out, '\n');
 
 	if (entroid)
-		fputs(entroid->comment->str, s);
+		g_string_append_len(
+			out, entroid->comment->str, entroid->comment->len);
 	for (i = 0; i < attributes->len; i++) {
 		tattribute *attribute = g_ptr_array_index(attributes, i);
 		char *ad = attribute_ad(attribute);
 		if ( entroid && !entroid_remove_ad(entroid, ad))
-			fprintf(s, "# WARNING: %s not allowed by schema\n",
-				ad);
-		print_attribute(s, attribute);
+			print_schema_warning(out, ad);
+		print_attribute(out, attribute);
 	}
 	if (entroid)
-		print_entroid_bottom(s, entroid);
+		print_entroid_bottom(out, entroid);
+	print_out(s, out);
 }
 
 static void
-print_ldapvi_ldapmod(FILE *s, LDAPMod *mod)
+print_ldapvi_ldapmod(GString *out, LDAPMod *mod)
 {
 	struct berval **values = mod->mod_bvalues;
 
 	switch (mod->mod_op & ~LDAP_MOD_BVALUES) {
-	case LDAP_MOD_ADD: fputs("add", s); break;
-	case LDAP_MOD_DELETE: fputs("delete", s); break;
-	case LDAP_MOD_REPLACE: fputs("replace", s); break;
+	case LDAP_MOD_ADD: g_string_append(out, "add"); break;
+	case LDAP_MOD_DELETE: g_string_append(out, "delete"); break;
+	case LDAP_MOD_REPLACE: g_string_append(out, "replace"); break;
 	default: abort();
 	}
-	print_attrval(s, mod->mod_type, strlen(mod->mod_type), 0);
-	fputc('\n', s);
+	print_attrval(out, mod->mod_type, strlen(mod->mod_type), 0);
+	g_string_append_c(out, '\n');
 	for (; *values; values++) {
 		struct berval *value = *values;
-		print_attrval(s, value->bv_val, value->bv_len, 0);
-		fputc('\n', s);
+		print_attrval(out, value->bv_val, value->bv_len, 0);
+		g_string_append_c(out, '\n');
 	}
-	if (ferror(s)) syserr();
 }
 
 void
 print_ldapvi_modify(FILE *s, char *dn, LDAPMod **mods)
 {
-	fputs("\nmodify", s);
-	print_attrval(s, dn, strlen(dn), 1);
-	fputc('\n', s);
+	GString *out = g_string_new("\nmodify");
+
+	print_attrval(out, dn, strlen(dn), 1);
+	g_string_append_c(out, '\n');
 
 	for (; *mods; mods++)
-		print_ldapvi_ldapmod(s, *mods);
-	if (ferror(s)) syserr();
+		print_ldapvi_ldapmod(out, *mods);
+	print_out(s, out);
 }
 
 void
 print_ldapvi_rename(FILE *s, char *olddn, char *newdn, int deleteoldrdn)
 {
-	fputs("\nrename", s);
-	print_attrval(s, olddn, strlen(olddn), 1);
-	fputs(deleteoldrdn ? "\nreplace" : "\nadd", s);
-	print_attrval(s, newdn, strlen(newdn), 0);
-	fputc('\n', s);
-	if (ferror(s)) syserr();
+	GString *out = g_string_new("\nrename");
+
+	print_attrval(out, olddn, strlen(olddn), 1);
+	g_string_append(out, deleteoldrdn ? "\nreplace" : "\nadd");
+	print_attrval(out, newdn, strlen(newdn), 0);
+	g_string_append_c(out, '\n');
+	print_out(s, out);
 }
 
 static GString *
@@ -279,118 +415,125 @@ void
 print_ldapvi_modrdn(FILE *s, char *olddn, char *newrdn, int deleteoldrdn)
 {
 	char **newrdns = ldap_explode_dn(olddn, 0);
+	GString *out = g_string_new("\nrename");
 	GString *newdn;
 	char *tmp;
 
-	fputs("\nrename", s);
-	print_attrval(s, olddn, strlen(olddn), 1);
-	fputs(deleteoldrdn ? "\nreplace" : "\nadd", s);
+	print_attrval(out, olddn, strlen(olddn), 1);
+	g_string_append(out, deleteoldrdn ? "\nreplace" : "\nadd");
 
 	/* fixme, siehe notes */
 	tmp = *newrdns;
 	*newrdns = newrdn;
 	newdn = rdns2gstring(newrdns);
-	print_attrval(s, newdn->str, newdn->len, 0);
-	fputc('\n', s);
+	print_attrval(out, newdn->str, newdn->len, 0);
+	g_string_append_c(out, '\n');
 	g_string_free(newdn, 1);
 	*newrdns = tmp;
 
-	if (ferror(s)) syserr();
+	print_out(s, out);
 	ldap_value_free(newrdns);
 }
 
 void
 print_ldapvi_add(FILE *s, char *dn, LDAPMod **mods)
 {
-	fputs("\nadd", s);
-	print_attrval(s, dn, strlen(dn), 1);
-	fputc('\n', s);
+	GString *out = g_string_new("\nadd");
+
+	print_attrval(out, dn, strlen(dn), 1);
+	g_string_append_c(out, '\n');
 
 	for (; *mods; mods++) {
 		LDAPMod *mod = *mods;
 		struct berval **values = mod->mod_bvalues;
 		for (; *values; values++) {
 			struct berval *value = *values;
-			fputs(mod->mod_type, s);
-			print_attrval(s, value->bv_val, value->bv_len, 0);
-			fputc('\n', s);
+			g_string_append(out, mod->mod_type);
+			print_attrval(out, value->bv_val, value->bv_len, 0);
+			g_string_append_c(out, '\n');
 		}
 	}
-	if (ferror(s)) syserr();
+	print_out(s, out);
 }
 
 void
 print_ldapvi_delete(FILE *s, char *dn)
 {
-	fputs("\ndelete", s);
-	print_attrval(s, dn, strlen(dn), 1);
-	fputc('\n', s);
-	if (ferror(s)) syserr();
+	GString *out = g_string_new("\ndelete");
+
+	print_attrval(out, dn, strlen(dn), 1);
+	g_string_append_c(out, '\n');
+	print_out(s, out);
 }
 
 static void
-print_ldif_line(FILE *s, char *ad, char *str, int len)
+print_ldif_line(GString *out, char *ad, int adlen, char *str, int len)
 {
 	if (len == -1)
 		len = strlen(str);
-	fputs(ad, s);
+	g_string_append_len(out, ad, adlen);
 	if (safe_string_p(str, len)) {
-		fputs(": ", s);
-		fwrite(str, len, 1, s);
+		g_string_append_len(out, ": ", 2);
+		g_string_append_len(out, str, len);
 	} else {
-		fputs(":: ", s);
-		print_base64((unsigned char *) str, len, s);
+		g_string_append_len(out, ":: ", 3);
+		g_string_append_base64(out, (unsigned char *) str, len);
 	}
-	fputs("\n", s);
+	g_string_append_c(out, '\n');
 }
 
+#define print_ldif_line0(out, ad, str, len) \
+	print_ldif_line((out), (ad), strlen(ad), (str), (len))
+
 static void
-print_ldif_bervals(FILE *s, char *ad, struct berval **values)
+print_ldif_bervals(GString *out, char *ad, struct berval **values)
 {
+	int adlen = strlen(ad);
 	for (; *values; values++) {
 		struct berval *value = *values;
-		print_ldif_line(s, ad, value->bv_val, value->bv_len);
+		print_ldif_line(out, ad, adlen, value->bv_val, value->bv_len);
 	}
-	if (ferror(s)) syserr();
 }
 
 void
 print_ldif_modify(FILE *s, char *dn, LDAPMod **mods)
 {
-	fputc('\n', s);
-	print_ldif_line(s, "dn", dn, -1);
-	fputs("changetype: modify\n", s);
+	GString *out = g_string_new("\n");
+
+	print_ldif_line0(out, "dn", dn, -1);
+	g_string_append(out, "changetype: modify\n");
 
 	for (; *mods; mods++) {
 		LDAPMod *mod = *mods;
 
 		switch (mod->mod_op & ~LDAP_MOD_BVALUES) {
-		case LDAP_MOD_ADD: fputs("add: ", s); break;
-		case LDAP_MOD_DELETE: fputs("delete: ", s); break;
-		case LDAP_MOD_REPLACE: fputs("replace: ", s); break;
+		case LDAP_MOD_ADD: g_string_append(out, "add: "); break;
+		case LDAP_MOD_DELETE: g_string_append(out, "delete: "); break;
+		case LDAP_MOD_REPLACE: g_string_append(out, "replace: "); break;
 		default: abort();
 		}
-		fputs(mod->mod_type, s);
-		fputc('\n', s);
+		g_string_append(out, mod->mod_type);
+		g_string_append_c(out, '\n');
 
-		print_ldif_bervals(s, mod->mod_type, mod->mod_bvalues);
-		fputs("-\n", s);
+		print_ldif_bervals(out, mod->mod_type, mod->mod_bvalues);
+		g_string_append(out, "-\n");
 	}
-	if (ferror(s)) syserr();
+	print_out(s, out);
 }
 
 void
 print_ldif_add(FILE *s, char *dn, LDAPMod **mods)
 {
-	fputc('\n', s);
-	print_ldif_line(s, "dn", dn, -1);
-	fputs("changetype: add\n", s);
+	GString *out = g_string_new("\n");
+
+	print_ldif_line0(out, "dn", dn, -1);
+	g_string_append(out, "changetype: add\n");
 
 	for (; *mods; mods++) {
 		LDAPMod *mod = *mods;
-		print_ldif_bervals(s, mod->mod_type, mod->mod_bvalues);
+		print_ldif_bervals(out, mod->mod_type, mod->mod_bvalues);
 	}
-	if (ferror(s)) syserr();
+	print_out(s, out);
 }
 
 void
@@ -398,25 +541,25 @@ print_ldif_rename(FILE *s, char *olddn, char *newdn, int deleteoldrdn)
 {
 	char **newrdns = ldap_explode_dn(newdn, 0);
 	int isRootDSE = !*newrdns;
+	GString *out = g_string_new("\n");
 	GString *sup;
 
-	fputc('\n', s);
-	print_ldif_line(s, "dn", olddn, -1);
-	fputs("changetype: modrdn\n", s);
+	print_ldif_line0(out, "dn", olddn, -1);
+	g_string_append(out, "changetype: modrdn\n");
 
-	print_ldif_line(s, "newrdn", isRootDSE ? "" : *newrdns, -1);
+	print_ldif_line0(out, "newrdn", isRootDSE ? "" : *newrdns, -1);
 
-	fprintf(s, "deleteoldrdn: %d\n", !!deleteoldrdn);
+	g_string_append_printf(out, "deleteoldrdn: %d\n", !!deleteoldrdn);
 
 	if (isRootDSE || !newrdns[1])
-		fputs("newsuperior:\n", s);
+		g_string_append(out, "newsuperior:\n");
 	else {
 		sup = rdns2gstring(newrdns + 1);
-		print_ldif_line(s, "newsuperior", sup->str, sup->len);
+		print_ldif_line0(out, "newsuperior", sup->str, sup->len);
 		g_string_free(sup, 1);
 	}
 
-	if (ferror(s)) syserr();
+	print_out(s, out);
 	ldap_value_free(newrdns);
 }
 
@@ -424,62 +567,70 @@ print_ldif_rename(FILE *s, char *olddn, char *newdn, int deleteoldrdn)
 void
 print_ldif_modrdn(FILE *s, char *olddn, char *newrdn, int deleteoldrdn)
 {
-	fputc('\n', s);
-	print_ldif_line(s, "dn", olddn, -1);
-	fputs("changetype: modrdn\n", s);
-	print_ldif_line(s, "newrdn", newrdn, -1);
-	fprintf(s, "deleteoldrdn: %d\n", !!deleteoldrdn);
-	if (ferror(s)) syserr();
+	GString *out = g_string_new("\n");
+
+	print_ldif_line0(out, "dn", olddn, -1);
+	g_string_append(out, "changetype: modrdn\n");
+	print_ldif_line0(out, "newrdn", newrdn, -1);
+	g_string_append_printf(out, "deleteoldrdn: %d\n", !!deleteoldrdn);
+	print_out(s, out);
 }
 
 void
 print_ldif_delete(FILE *s, char *dn)
 {
-	fputc('\n', s);
-	print_ldif_line(s, "dn", dn, -1);
-	fputs("changetype: delete\n", s);
-	if (ferror(s)) syserr();
+	GString *out = g_string_new("\n");
+
+	print_ldif_line0(out, "dn", dn, -1);
+	g_string_append(out, "changetype: delete\n");
+	print_out(s, out);
 }
 
+/*
+ * The message printers walk the entry's BerElement in place: the DN,
+ * attribute descriptions and values all point into the receive buffer
+ * and are copied only once, into the writer's buffer.
+ */
 void
-print_ldapvi_message(FILE *s, LDAP *ld, LDAPMessage *entry, int key,
+print_ldapvi_message(twriter *w, LDAP *ld, LDAPMessage *entry, int key,
 		    tentroid *entroid)
 {
-	char *dn, *ad;
+	GString *out = w->buf;
 	BerElement *ber;
-
-	fprintf(s, "\n%d", key);
-	dn = ldap_get_dn(ld, entry);
-	print_attrval(s, dn, strlen(dn), 1);
-	ldap_memfree(dn);
-	fputc('\n', s);
+	struct berval dn, ad;
+	struct berval *values, *ptr;
+	int rc;
+
+	if (ldap_get_dn_ber(ld, entry, &ber, &dn))
+		ldaperr(ld, "ldap_get_dn_ber");
+	g_string_append_printf(out, "\n%d", key);
+	print_attrval(out, dn.bv_val, dn.bv_len, 1);
+	g_string_append_c(out, '\n');
 	if (entroid)
-		fputs(entroid->comment->str, s);
+		g_string_append_len(
+			out, entroid->comment->str, entroid->comment->len);
 
-	for (ad = ldap_first_attribute(ld, entry, &ber);
-	     ad;
-	     ad = ldap_next_attribute(ld, entry, ber))
+	for (rc = ldap_get_attribute_ber(ld, entry, ber, &ad, &values);
+	     rc == LDAP_SUCCESS && ad.bv_val;
+	     rc = ldap_get_attribute_ber(ld, entry, ber, &ad, &values))
 	{
-		struct berval **values = ldap_get_values_len(ld, entry, ad);
-		struct berval **ptr;
-
 		if (!values) continue;
 		if (entroid)
-			entroid_remove_ad(entroid, ad);
+			entroid_remove_ad(entroid, ad.bv_val);
 
-		for (ptr = values; *ptr; ptr++) {
-			fputs(ad, s);
-			print_attrval(s, (*ptr)->bv_val, (*ptr)->bv_len, 0);
-			fputc('\n', s);
+		for (ptr = values; ptr->bv_val; ptr++) {
+			g_string_append_len(out, ad.bv_val, ad.bv_len);
+			print_attrval(out, ptr->bv_val, ptr->bv_len, 0);
+			g_string_append_c(out, '\n');
 		}
-		ldap_memfree(ad);
-		ldap_value_free_len(values);
+		ber_memfree(values);
 	}
+	if (rc != LDAP_SUCCESS)
+		ldaperr(ld, "ldap_get_attribute_ber");
 	ber_free(ber, 0);
 
 	if (entroid)
-		print_entroid_bottom(s, entroid);
-	if (ferror(s)) syserr();
+		print_entroid_bottom(out, entroid);
 }
 
 void
@@ -487,63 +638,74 @@ print_ldif_entry(FILE *s, tentry *entry, char *key, tentroid *entroid)
 {
 	int i;
 	GPtrArray *attributes = entry_attributes(entry);
+	GString *out = g_string_new("\n");
 
-	fputc('\n', s);
-	print_ldif_line(s, "dn", entry_dn(entry), -1);
-	if (key)
-		fprintf(s, "ldapvi-key: %s\n", key);
+	print_ldif_line0(out, "dn", entry_dn(entry), -1);
+	if (key) {
+		g_string_append(out, "ldapvi-key: ");
+		g_string_append(out, key);
+		g_string_append_c(out, '\n');
+	}
 	if (entroid)
-		fputs(entroid->comment->str, s);
+		g_string_append_len(
+			out, entroid->comment->str, entroid->comment->len);
 	for (i = 0; i < attributes->len; i++) {
 		tattribute *attribute = g_ptr_array_index(attributes, i);
 		char *ad = attribute_ad(attribute);
+		int adlen = strlen(ad);
 		GPtrArray *values = attribute_values(attribute);
 		int j;
 
 		if ( entroid && !entroid_remove_ad(entroid, ad))
-			fprintf(s, "# WARNING: %s not allowed by schema\n",
-				ad);
+			print_schema_warning(out, ad);
 
 		for (j = 0; j < values->len; j++) {
 			GArray *av = g_ptr_array_index(values, j);
-			print_ldif_line(s, ad, av->data, av->len);
+			print_ldif_line(out, ad, adlen, av->data, av->len);
 		}
 	}
 	if (entroid)
-		print_entroid_bottom(s, entroid);
+		print_entroid_bottom(out, entroid);
+	print_out(s, out);
 }
 
 void
-print_ldif_message(FILE *s, LDAP *ld, LDAPMessage *entry, int key,
+print_ldif_message(twriter *w, LDAP *ld, LDAPMessage *entry, int key,
 		   tentroid *entroid)
 {
-	char *dn, *ad;
+	GString *out = w->buf;
 	BerElement *ber;
+	struct berval dn, ad;
+	struct berval *values, *ptr;
+	int rc;
 
-	fputc('\n', s);
+	g_string_append_c(out, '\n');
 	if (entroid)
-		fputs(entroid->comment->str, s);
+		g_string_append_len(
+			out, entroid->comment->str, entroid->comment->len);
 
-	dn = ldap_get_dn(ld, entry);
-	print_ldif_line(s, "dn", dn, -1);
-	ldap_memfree(dn);
+	if (ldap_get_dn_ber(ld, entry, &ber, &dn))
+		ldaperr(ld, "ldap_get_dn_ber");
+	print_ldif_line0(out, "dn", dn.bv_val, dn.bv_len);
 
 	if (key != -1)
-		fprintf(s, "ldapvi-key: %d\n", key);
+		g_string_append_printf(out, "ldapvi-key: %d\n", key);
 
-	for (ad = ldap_first_attribute(ld, entry, &ber);
-	     ad;
-	     ad = ldap_next_attribute(ld, entry, ber))
+	for (rc = ldap_get_attribute_ber(ld, entry, ber, &ad, &values);
+	     rc == LDAP_SUCCESS && ad.bv_val;
+	     rc = ldap_get_attribute_ber(ld, entry, ber, &ad, &values))
 	{
-		struct berval **values = ldap_get_values_len(ld, entry, ad);
-		if (entroid) entroid_remove_ad(entroid, ad);
-		print_ldif_bervals(s, ad, values);
-		ldap_memfree(ad);
-		ldap_value_free_len(values);
+		if (!values) continue;
+		if (entroid) entroid_remove_ad(entroid, ad.bv_val);
+		for (ptr = values; ptr->bv_val; ptr++)
+			print_ldif_line(out, ad.bv_val, ad.bv_len,
+					ptr->bv_val, ptr->bv_len);
+		ber_memfree(values);
 	}
+	if (rc != LDAP_SUCCESS)
+		ldaperr(ld, "ldap_get_attribute_ber");
 	ber_free(ber, 0);
 
 	if (entroid)
-		print_entroid_bottom(s, entroid);
-	if (ferror(s)) syserr();
+		print_entroid_bottom(out, entroid);
 }
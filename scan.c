@@ -0,0 +1,169 @@
+/* -*- show-trailing-whitespace: t; indent-tabs: t -*-
+ * Copyright (c) 2003,2004,2005,2006 David Lichteblau
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA.
+ */
+#define _GNU_SOURCE
+#include "common.h"
+#include "config.h"
+
+/*
+ * Scanning for both parsers.
+ *
+ * Instead of reading a byte at a time, the parsers read up to the
+ * character that ends the current token in one call and search the
+ * result with memchr() for characters needing special treatment.  Both
+ * are done in bulk by the C library.  The parsers depend on ftell() and
+ * fseek() anyway, so the rare token that was read too far is simply
+ * taken back with scan_unread().
+ *
+ * The buffer belongs to the calling thread, since diff.c parses in
+ * several threads at once.
+ */
+typedef struct tscanbuf {
+	char *str;
+	size_t size;
+} tscanbuf;
+
+static void
+scanbuf_free(gpointer p)
+{
+	tscanbuf *buf = p;
+	free(buf->str);
+	free(buf);
+}
+
+static GPrivate scanbuf_key = G_PRIVATE_INIT(scanbuf_free);
+
+static tscanbuf *
+scanbuf(void)
+{
+	tscanbuf *buf = g_private_get(&scanbuf_key);
+	if (!buf) {
+		buf = xalloc(sizeof(tscanbuf));
+		buf->str = 0;
+		buf->size = 0;
+		g_private_set(&scanbuf_key, buf);
+	}
+	return buf;
+}
+
+/*
+ * Read from S up to and including the next DELIM, or up to the end of
+ * file.  *RESULT is set to the bytes read, valid until the next call in
+ * this thread, and NUL-terminated for convenience.  Return the number
+ * of bytes read, 0 at end of file.
+ */
+long
+scan_until(FILE *s, int delim, char **result)
+{
+	tscanbuf *buf = scanbuf();
+	long n;
+
+#ifdef HAVE_GETDELIM
+	if ( (n = getdelim(&buf->str, &buf->size, delim, s)) == -1) {
+		if (ferror(s)) syserr();
+		n = 0;
+	}
+#else
+	int c;
+
+	n = 0;
+	do {
+		if (n + 1 >= buf->size) {
+			buf->size = buf->size ? 2 * buf->size : 128;
+			buf->str = realloc(buf->str, buf->size);
+			if (!buf->str) syserr();
+		}
+		if ( (c = getc_unlocked(s)) == EOF) {
+			if (ferror(s)) syserr();
+			break;
+		}
+		buf->str[n++] = c;
+	} while (c != delim);
+#endif
+	if (!buf->str)
+		buf->str = xalloc(buf->size = 1);
+	buf->str[n] = 0;
+	*result = buf->str;
+	return n;
+}
+
+/*
+ * Move S back by N bytes.
+ */
+void
+scan_unread(FILE *s, long n)
+{
+	if (n && fseek(s, -n, SEEK_CUR) == -1) syserr();
+}
+
+/*
+ * Return the first byte in PTR[0..N) that occurs in SET, which consists
+ * of NSET bytes and may include its terminating NUL, or 0 if there is
+ * none.  Each memchr() call is limited to the part before the earliest
+ * match so far.
+ */
+char *
+scan_any(char *ptr, long n, char *set, int nset)
+{
+	char *result = 0;
+	int i;
+
+	for (i = 0; i < nset; i++) {
+		char *q = memchr(ptr, set[i], result ? result - ptr : n);
+		if (q) result = q;
+	}
+	return result;
+}
+
+/*
+ * Read the rest of a logical line, which may be folded by starting the
+ * continuation lines with a space, and append it to DATA without the
+ * line breaks.  DATA may be null to skip the line.  With CRLF, "\r\n"
+ * is a line break, too, and other carriage returns are a parse error.
+ *
+ * 0: ok
+ * -1: parse error
+ */
+int
+scan_folded(FILE *s, GString *data, int crlf)
+{
+	for (;;) {
+		char *line;
+		long n = scan_until(s, '\n', &line);
+		int c;
+
+		if (!n || line[n - 1] != '\n') {
+			complain(stderr, "Error: Unexpected EOF.\n");
+			return -1;
+		}
+		n--;
+		if (crlf) {
+			char *cr = memchr(line, '\r', n);
+			if (cr && cr != line + n - 1) {
+				scan_unread(s, n - (cr - line) - 1);
+				return -1;
+			}
+			if (cr) n--;
+		}
+		if (data)
+			g_string_append_len(data, line, n);
+		if ( (c = getc_unlocked(s)) == ' ') /* folded line */ continue;
+		ungetc(c, s);
+		return 0;
+	}
+}
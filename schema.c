@@ -30,6 +30,30 @@ schema_get_attributetype(tschema *schema, char *name)
 	return g_hash_table_lookup(schema->types, name);
 }
 
+/*
+ * Return true if attribute AD (options are ignored) or one of its
+ * supertypes has a SUBSTR matching rule, i.e. if substring filters on
+ * AD are not Undefined.
+ */
+int
+schema_substr_p(tschema *schema, char *ad)
+{
+	char *type = g_strndup(ad, strcspn(ad, ";"));
+	LDAPAttributeType *at = schema_get_attributetype(schema, type);
+	int depth;
+
+	g_free(type);
+	/* the depth limit guards against SUP cycles */
+	for (depth = 0; at && depth < 16; depth++) {
+		if (at->at_substr_oid)
+			return 1;
+		if (!at->at_sup_oid)
+			break;
+		at = schema_get_attributetype(schema, at->at_sup_oid);
+	}
+	return 0;
+}
+
 char *
 objectclass_name(LDAPObjectClass *cls)
 {
@@ -120,6 +144,80 @@ free_type(gpointer key, gpointer value, gpointer data)
 	ldap_attributetype_free(value);
 }
 
+static void
+free_entroid(gpointer key, gpointer value, gpointer data)
+{
+	g_free(key);
+	entroid_free(value);
+}
+
+/*
+ * entroid->bits holds three bitsets of schema->ntypes bits each, indexed
+ * by the attribute type number from schema_index_types():  required
+ * attributes, optional attributes, and attributes seen in the entry.
+ * The must and may arrays list the same types as the first two bitsets,
+ * in schema order, for output.
+ */
+#define BITSET_WORDS(schema) (((schema)->ntypes + 31) / 32)
+#define MUST_BITS(entroid) ((entroid)->bits)
+#define MAY_BITS(entroid) \
+	((entroid)->bits + BITSET_WORDS((entroid)->schema))
+#define SEEN_BITS(entroid) \
+	((entroid)->bits + 2 * BITSET_WORDS((entroid)->schema))
+#define BIT_TEST(bits, n) ((bits)[(n) / 32] & (1U << ((n) % 32)))
+#define BIT_SET(bits, n) ((bits)[(n) / 32] |= (1U << ((n) % 32)))
+#define BIT_CLEAR(bits, n) ((bits)[(n) / 32] &= ~(1U << ((n) % 32)))
+
+static int
+type_index(tschema *schema, LDAPAttributeType *at)
+{
+	return GPOINTER_TO_INT(g_hash_table_lookup(schema->index, at)) - 1;
+}
+
+/*
+ * Object class information resolved at schema load time:  direct
+ * superclasses, required and optional attribute types, and the
+ * transitive closure of superclasses, including the class itself.
+ *
+ * CLOSURE_MUST and CLOSURE_MAY are the attribute types required and
+ * allowed by the closure as a whole, both as lists in schema order and
+ * as bitsets like those of an entroid.  A type required by any class in
+ * the closure is not also listed as optional.
+ *
+ * ERROR is the message for the first unresolvable reference anywhere in
+ * the closure, since any entry using this class would run into it.
+ */
+typedef struct tclassinfo {
+	GPtrArray *sups;
+	GPtrArray *must;
+	GPtrArray *may;
+	GPtrArray *closure;
+	GPtrArray *closure_must;
+	GPtrArray *closure_may;
+	guint32 *bits;
+	char *missing;
+	char *error;
+} tclassinfo;
+
+#define CLOSURE_MUST_BITS(schema, info) ((info)->bits)
+#define CLOSURE_MAY_BITS(schema, info) \
+	((info)->bits + BITSET_WORDS(schema))
+
+static void
+free_classinfo(gpointer key, gpointer value, gpointer data)
+{
+	tclassinfo *info = value;
+	g_ptr_array_free(info->sups, 1);
+	g_ptr_array_free(info->must, 1);
+	g_ptr_array_free(info->may, 1);
+	g_ptr_array_free(info->closure, 1);
+	g_ptr_array_free(info->closure_must, 1);
+	g_ptr_array_free(info->closure_may, 1);
+	free(info->bits);
+	if (info->missing) g_free(info->missing);
+	free(info);
+}
+
 void
 schema_free(tschema *schema)
 {
@@ -129,11 +227,428 @@ schema_free(tschema *schema)
 	g_hash_table_foreach(schema->classes, free_class, 0);
 	g_hash_table_foreach(schema->types, free_type, 0);
 
+	g_hash_table_foreach(schema->entroids, free_entroid, 0);
+	g_hash_table_foreach(schema->classinfo, free_classinfo, 0);
+
 	g_hash_table_destroy(schema->classes);
 	g_hash_table_destroy(schema->types);
+	g_hash_table_destroy(schema->entroids);
+	g_hash_table_destroy(schema->index);
+	g_hash_table_destroy(schema->classinfo);
 	free(schema);
 }
 
+/*
+ * Schema cache.
+ *
+ * Parsing a big schema takes a long time, so we keep the parts of it we
+ * actually use in a file below ~/.cache/ldapvi, one per server, subschema
+ * entry and bind identity, since access control can hide parts of the
+ * schema from some users.  The cache is valid as long as the subschema
+ * entry's modifyTimestamp and entryCSN are unchanged.  Servers that
+ * provide neither attribute are not cached.
+ *
+ * File format, one definition per line, fields separated by tabs, list
+ * elements separated by spaces:
+ *   ldapvi-schema 3 <uri> <subschema dn> <identity> <stamp>
+ *   c <oid> <kind> <names> <superclasses> <must> <may>
+ *   t <oid> <names> <supertype> <substring rule>
+ */
+#define SCHEMA_CACHE_MAGIC "ldapvi-schema 3"
+
+static char *
+schema_cache_filename(char *uri, char *dn, char *identity)
+{
+	char *cache = getenv("XDG_CACHE_HOME");
+	char *dir;
+	char *result;
+	guint64 h = FNV_BASIS;
+
+	h = fnv_hash(h, uri, strlen(uri));
+	h = fnv_hash(h, "\n", 1);
+	h = fnv_hash(h, dn, strlen(dn));
+	h = fnv_hash(h, "\n", 1);
+	h = fnv_hash(h, identity, strlen(identity));
+
+	if (cache && *cache)
+		dir = g_strdup_printf("%s/ldapvi", cache);
+	else {
+		char *home = home_filename(".cache/ldapvi");
+		if (!home) return 0;
+		dir = g_strdup(home);
+		free(home);
+	}
+	if (g_mkdir_with_parents(dir, 0700) == -1) {
+		g_free(dir);
+		return 0;
+	}
+	result = g_strdup_printf(
+		"%s/schema-%08x%08x", dir,
+		(unsigned) (h >> 32), (unsigned) (h & 0xffffffff));
+	g_free(dir);
+	return result;
+}
+
+/*
+ * Return the authorization identity LD is bound as, "" when anonymous
+ * or if the server does not support the Who am I? operation.
+ */
+static char *
+schema_identity(LDAP *ld)
+{
+	struct berval *authzid = 0;
+	char *result;
+
+	if (ldap_whoami_s(ld, &authzid, 0, 0) != LDAP_SUCCESS || !authzid)
+		return xdup("");
+	result = xalloc(authzid->bv_len + 1);
+	memcpy(result, authzid->bv_val, authzid->bv_len);
+	result[authzid->bv_len] = 0;
+	ber_bvfree(authzid);
+	return result;
+}
+
+/*
+ * Read the subschema entry's modification stamp, or return 0 if the
+ * server doesn't tell us.
+ */
+static char *
+schema_stamp(LDAP *ld, char *dn)
+{
+	char *attrs[3] = {"modifyTimestamp", "entryCSN", 0};
+	LDAPMessage *result, *entry;
+	GString *stamp = g_string_new("");
+	char **values;
+	int i = 0;
+
+	if (ldap_search_s(ld, dn, LDAP_SCOPE_BASE, 0, attrs, 0, &result))
+		return 0;
+	if ( (entry = ldap_first_entry(ld, result)))
+		for (i = 0; attrs[i]; i++) {
+			values = ldap_get_values(ld, entry, attrs[i]);
+			g_string_append_c(stamp, ' ');
+			if (values && *values)
+				g_string_append(stamp, *values);
+			if (values) ldap_value_free(values);
+		}
+	ldap_msgfree(result);
+	if (stamp->len <= i) {
+		g_string_free(stamp, 1);
+		return 0;
+	}
+	return g_string_free(stamp, 0);
+}
+
+static void
+write_list(FILE *s, char **list)
+{
+	fputc('\t', s);
+	for (; list && *list; list++) {
+		fputs(*list, s);
+		if (list[1]) fputc(' ', s);
+	}
+}
+
+static void
+write_class(gpointer key, gpointer value, gpointer data)
+{
+	LDAPObjectClass *cls = value;
+	FILE *s = data;
+
+	if (strcmp(key, cls->oc_oid))
+		return;
+	fprintf(s, "c\t%s\t%d", cls->oc_oid, cls->oc_kind);
+	write_list(s, cls->oc_names);
+	write_list(s, cls->oc_sup_oids);
+	write_list(s, cls->oc_at_oids_must);
+	write_list(s, cls->oc_at_oids_may);
+	fputc('\n', s);
+}
+
+static void
+write_type(gpointer key, gpointer value, gpointer data)
+{
+	LDAPAttributeType *at = value;
+	FILE *s = data;
+
+	if (strcmp(key, at->at_oid))
+		return;
+	fprintf(s, "t\t%s", at->at_oid);
+	write_list(s, at->at_names);
+	fprintf(s, "\t%s\t%s\n",
+		at->at_sup_oid ? at->at_sup_oid : "",
+		at->at_substr_oid ? at->at_substr_oid : "");
+}
+
+static void
+schema_cache_write(tschema *schema, char *filename, char *header)
+{
+	char *tmp = g_strdup_printf("%s.%d", filename, (int) getpid());
+	FILE *s = fopen(tmp, "w");
+
+	if (!s) {
+		g_free(tmp);
+		return;
+	}
+	fputs(header, s);
+	g_hash_table_foreach(schema->classes, write_class, s);
+	g_hash_table_foreach(schema->types, write_type, s);
+	if (ferror(s) | fclose(s) || rename(tmp, filename) == -1)
+		unlink(tmp);
+	g_free(tmp);
+}
+
+/*
+ * Split the space-separated list STR into a NULL-terminated array that
+ * ldap_objectclass_free() and friends can free.
+ */
+static char **
+read_list(char *str)
+{
+	char **result;
+	char *ptr;
+	int n = 1;
+	int i = 0;
+
+	if (!*str)
+		return 0;
+	for (ptr = str; *ptr; ptr++)
+		if (*ptr == ' ') n++;
+	result = ber_memcalloc(n + 1, sizeof(char *));
+	for (;;) {
+		ptr = strchr(str, ' ');
+		if (ptr) *ptr = 0;
+		result[i++] = ber_strdup(str);
+		if (!ptr) break;
+		str = ptr + 1;
+	}
+	return result;
+}
+
+static int
+schema_cache_read(tschema *schema, char *filename, char *header)
+{
+	FILE *s = fopen(filename, "r");
+	char *line;
+	long n;
+	char *fields[7];
+	int nfields;
+	int rc = -1;
+
+	if (!s)
+		return -1;
+	if (!scan_until(s, '\n', &line) || strcmp(line, header))
+		goto done;
+	while ( (n = scan_until(s, '\n', &line))) {
+		char *ptr = line;
+
+		if (line[n - 1] != '\n')
+			goto done;
+		line[n - 1] = 0;
+		for (nfields = 0; nfields < 7; nfields++) {
+			fields[nfields] = ptr;
+			if ( !(ptr = strchr(ptr, '\t'))) {
+				nfields++;
+				break;
+			}
+			*ptr++ = 0;
+		}
+		if (!strcmp(fields[0], "c") && nfields == 7) {
+			LDAPObjectClass *cls
+				= ber_memcalloc(1, sizeof(LDAPObjectClass));
+			cls->oc_oid = ber_strdup(fields[1]);
+			cls->oc_kind = atoi(fields[2]);
+			cls->oc_names = read_list(fields[3]);
+			cls->oc_sup_oids = read_list(fields[4]);
+			cls->oc_at_oids_must = read_list(fields[5]);
+			cls->oc_at_oids_may = read_list(fields[6]);
+			add_objectclass(schema->classes, cls);
+		} else if (!strcmp(fields[0], "t") && nfields == 5) {
+			LDAPAttributeType *at
+				= ber_memcalloc(1, sizeof(LDAPAttributeType));
+			at->at_oid = ber_strdup(fields[1]);
+			at->at_names = read_list(fields[2]);
+			if (*fields[3])
+				at->at_sup_oid = ber_strdup(fields[3]);
+			if (*fields[4])
+				at->at_substr_oid = ber_strdup(fields[4]);
+			add_attributetype(schema->types, at);
+		} else
+			goto done;
+	}
+	rc = 0;
+done:
+	fclose(s);
+	return rc;
+}
+
+static tschema *
+schema_alloc(void)
+{
+	tschema *schema = xalloc(sizeof(tschema));
+	schema->classes = g_hash_table_new(strcasehash, strcaseequal);
+	schema->types = g_hash_table_new(strcasehash, strcaseequal);
+	schema->entroids = g_hash_table_new(g_str_hash, g_str_equal);
+	schema->index = g_hash_table_new(g_direct_hash, g_direct_equal);
+	schema->ntypes = 0;
+	schema->classinfo = g_hash_table_new(g_direct_hash, g_direct_equal);
+	return schema;
+}
+
+static void
+index_type(gpointer key, gpointer value, gpointer data)
+{
+	tschema *schema = data;
+
+	if (!g_hash_table_lookup(schema->index, value))
+		g_hash_table_insert(schema->index,
+				    value,
+				    GINT_TO_POINTER(++schema->ntypes));
+}
+
+/*
+ * Number the attribute types densely, so that entroids can represent
+ * sets of them as bitsets.
+ */
+static void
+schema_index_types(tschema *schema)
+{
+	g_hash_table_foreach(schema->types, index_type, schema);
+}
+
+static void
+resolve_types(tschema *schema,
+	      tclassinfo *info,
+	      char **names,
+	      GPtrArray *result)
+{
+	for (; names && *names; names++) {
+		LDAPAttributeType *at
+			= schema_get_attributetype(schema, *names);
+		if (at)
+			g_ptr_array_add(result, at);
+		else if (!info->missing)
+			info->missing = g_strdup_printf(
+				"Error: Attribute type not found: %s\n",
+				*names);
+	}
+}
+
+static void
+resolve_class(gpointer key, gpointer value, gpointer data)
+{
+	tschema *schema = data;
+	LDAPObjectClass *cls = value;
+	tclassinfo *info;
+	char **ptr;
+
+	if (g_hash_table_lookup(schema->classinfo, cls))
+		return;
+	info = xalloc(sizeof(tclassinfo));
+	info->sups = g_ptr_array_new();
+	info->must = g_ptr_array_new();
+	info->may = g_ptr_array_new();
+	info->closure = g_ptr_array_new();
+	info->closure_must = g_ptr_array_new();
+	info->closure_may = g_ptr_array_new();
+	info->bits = 0;
+	info->missing = 0;
+	info->error = 0;
+
+	for (ptr = cls->oc_sup_oids; ptr && *ptr; ptr++) {
+		LDAPObjectClass *sup = schema_get_objectclass(schema, *ptr);
+		if (sup)
+			g_ptr_array_add(info->sups, sup);
+		else if (!info->missing)
+			info->missing = g_strdup_printf(
+				"Error: Object class not found: %s\n",
+				*ptr);
+	}
+	resolve_types(schema, info, cls->oc_at_oids_must, info->must);
+	resolve_types(schema, info, cls->oc_at_oids_may, info->may);
+	g_hash_table_insert(schema->classinfo, cls, info);
+}
+
+/*
+ * Add the types in TYPES not yet in SKIP or BITS to BITS and LIST.
+ */
+static void
+close_types(tschema *schema,
+	    GPtrArray *types,
+	    guint32 *skip,
+	    guint32 *bits,
+	    GPtrArray *list)
+{
+	int i, n;
+
+	for (i = 0; i < types->len; i++) {
+		LDAPAttributeType *at = g_ptr_array_index(types, i);
+		n = type_index(schema, at);
+		if (BIT_TEST(skip, n) || BIT_TEST(bits, n))
+			continue;
+		BIT_SET(bits, n);
+		g_ptr_array_add(list, at);
+	}
+}
+
+static void
+close_class(gpointer key, gpointer value, gpointer data)
+{
+	tschema *schema = data;
+	tclassinfo *info = value;
+	int n = 2 * BITSET_WORDS(schema) * sizeof(guint32);
+	guint32 *must, *may;
+	int i, j;
+
+	g_ptr_array_add(info->closure, key);
+	for (i = 0; i < info->closure->len; i++) {
+		tclassinfo *sup = g_hash_table_lookup(
+			schema->classinfo,
+			g_ptr_array_index(info->closure, i));
+		if (sup->missing && !info->error)
+			info->error = sup->missing;
+		for (j = 0; j < sup->sups->len; j++)
+			adjoin_ptr(info->closure,
+				   g_ptr_array_index(sup->sups, j));
+	}
+
+	info->bits = xalloc(n + 1);
+	memset(info->bits, 0, n);
+	must = CLOSURE_MUST_BITS(schema, info);
+	may = CLOSURE_MAY_BITS(schema, info);
+	for (i = 0; i < info->closure->len; i++) {
+		tclassinfo *sup = g_hash_table_lookup(
+			schema->classinfo,
+			g_ptr_array_index(info->closure, i));
+		close_types(schema, sup->must, must, must, info->closure_must);
+	}
+	for (i = 0; i < info->closure->len; i++) {
+		tclassinfo *sup = g_hash_table_lookup(
+			schema->classinfo,
+			g_ptr_array_index(info->closure, i));
+		close_types(schema, sup->may, must, may, info->closure_may);
+	}
+}
+
+/*
+ * Resolve all references between object classes and attribute types
+ * once, warning about broken references, so that compute_entroid()
+ * need not look up names for every entry.
+ */
+static void
+schema_resolve_classes(tschema *schema)
+{
+	g_hash_table_foreach(schema->classes, resolve_class, schema);
+	g_hash_table_foreach(schema->classinfo, close_class, schema);
+}
+
+static void
+schema_prepare(tschema *schema)
+{
+	schema_index_types(schema);
+	schema_resolve_classes(schema);
+}
+
 tschema *
 schema_new(LDAP *ld)
 {
@@ -144,6 +659,10 @@ schema_new(LDAP *ld)
 	const char *errp;
 	char *attrs[2] = {"subschemaSubentry", 0};
 	tschema *schema;
+	char *uri = 0;
+	char *stamp;
+	char *cache = 0;
+	char *header = 0;
 
 	if (ldap_search_s(ld, "", LDAP_SCOPE_BASE, 0, attrs, 0, &result)) {
 		ldap_perror(ld, "ldap_search");
@@ -163,13 +682,37 @@ schema_new(LDAP *ld)
 	ldap_value_free(values);
 	ldap_msgfree(result);
 
+	if (ldap_get_option(ld, LDAP_OPT_URI, &uri) == LDAP_OPT_SUCCESS
+	    && uri
+	    && (stamp = schema_stamp(ld, subschema_dn)))
+	{
+		char *identity = schema_identity(ld);
+		cache = schema_cache_filename(uri, subschema_dn, identity);
+		header = g_strdup_printf(
+			SCHEMA_CACHE_MAGIC "\t%s\t%s\t%s\t%s\n",
+			uri, subschema_dn, identity, stamp);
+		free(identity);
+		g_free(stamp);
+	}
+	if (uri) ldap_memfree(uri);
+	if (cache) {
+		schema = schema_alloc();
+		if (!schema_cache_read(schema, cache, header)) {
+			schema_prepare(schema);
+			free(subschema_dn);
+			g_free(cache);
+			g_free(header);
+			return schema;
+		}
+		/* stale or damaged */
+		schema_free(schema);
+	}
+
 	entry = get_entry(ld, subschema_dn, &result);
 	free(subschema_dn);
 	values = ldap_get_values(ld, entry, "objectClasses");
 
-	schema = xalloc(sizeof(tschema));
-	schema->classes = g_hash_table_new(strcasehash, strcaseequal);
-	schema->types = g_hash_table_new(strcasehash, strcaseequal);
+	schema = schema_alloc();
 
 	if (values) {
 		char **ptr = values;
@@ -202,6 +745,13 @@ schema_new(LDAP *ld)
 		ldap_value_free(values);
 	}
 	ldap_msgfree(result);
+	schema_prepare(schema);
+
+	if (cache) {
+		schema_cache_write(schema, cache, header);
+		g_free(cache);
+		g_free(header);
+	}
 	return schema;
 }
 
@@ -209,19 +759,45 @@ tentroid *
 entroid_new(tschema *schema)
 {
 	tentroid *result = xalloc(sizeof(tentroid));
+	int n = 3 * BITSET_WORDS(schema) * sizeof(guint32);
 	result->schema = schema;
 	result->classes = g_ptr_array_new();
 	result->must = g_ptr_array_new();
 	result->may = g_ptr_array_new();
+	result->bits = xalloc(n + 1);
+	memset(result->bits, 0, n);
 	result->structural = 0;
 	result->comment = g_string_sized_new(0);
 	result->error = g_string_sized_new(0);
 	return result;
 }
 
+/*
+ * Clear the bitsets.  Only types listed in must and may can have a bit
+ * set, so this is proportional to the entry, not the schema.
+ */
+static void
+entroid_clear_bits(tentroid *entroid)
+{
+	GPtrArray *lists[2];
+	int i, j, n;
+
+	lists[0] = entroid->must;
+	lists[1] = entroid->may;
+	for (j = 0; j < 2; j++)
+		for (i = 0; i < lists[j]->len; i++) {
+			n = type_index(entroid->schema,
+				       g_ptr_array_index(lists[j], i));
+			BIT_CLEAR(MUST_BITS(entroid), n);
+			BIT_CLEAR(MAY_BITS(entroid), n);
+			BIT_CLEAR(SEEN_BITS(entroid), n);
+		}
+}
+
 void
 entroid_reset(tentroid *entroid)
 {
+	entroid_clear_bits(entroid);
 	g_ptr_array_set_size(entroid->classes, 0);
 	g_ptr_array_set_size(entroid->must, 0);
 	g_ptr_array_set_size(entroid->may, 0);
@@ -236,6 +812,7 @@ entroid_free(tentroid *entroid)
 	g_ptr_array_free(entroid->classes, 1);
 	g_ptr_array_free(entroid->must, 1);
 	g_ptr_array_free(entroid->may, 1);
+	free(entroid->bits);
 	g_string_free(entroid->comment, 1);
 	g_string_free(entroid->error, 1);
 	free(entroid);
@@ -277,70 +854,98 @@ entroid_request_class(tentroid *entroid, char *name)
 	return cls;
 }
 
+/*
+ * Mark attribute description AD as present in the entry.  Return true
+ * if the schema allows it.
+ */
 int
 entroid_remove_ad(tentroid *entroid, char *ad)
 {
 	LDAPAttributeType *at;
 	char *name;
 	char *s = strchr(ad, ';');
-	int found;
+	int n;
 
 	if (s) {
-		int n = s - ad;
-		name = xalloc(n);
+		n = s - ad;
+		name = xalloc(n + 1);
 		memcpy(name, ad, n);
+		name[n] = 0;
 	} else
 		name = ad;
 
-	if ( !(at = entroid_get_attributetype(entroid, name)))
-		return 0;
-	found = g_ptr_array_remove(entroid->must, at);
-	found |= g_ptr_array_remove(entroid->may, at);
-
+	at = entroid_get_attributetype(entroid, name);
 	if (name != ad)
 		free(name);
-	return found;
+	if (!at)
+		return 0;
+
+	n = type_index(entroid->schema, at);
+	if (!BIT_TEST(MUST_BITS(entroid), n) && !BIT_TEST(MAY_BITS(entroid), n))
+		return 0;
+	BIT_SET(SEEN_BITS(entroid), n);
+	return 1;
 }
 
-static int
-compute_entroid_1(tentroid *entroid, LDAPObjectClass *cls)
+/*
+ * Return true if entroid_remove_ad() has been called for AT.
+ */
+int
+entroid_seen(tentroid *entroid, LDAPAttributeType *at)
 {
-	char **ptr;
+	return BIT_TEST(SEEN_BITS(entroid), type_index(entroid->schema, at))
+		!= 0;
+}
 
-	for (ptr = cls->oc_sup_oids; ptr && *ptr; ptr++)
-		if (!entroid_request_class(entroid, *ptr))
-			return -1;
-	if (cls->oc_kind == LDAP_SCHEMA_STRUCTURAL) {
-		char *str;
-		if (entroid->structural)
-			str = "### WARNING: extra structural object class: ";
-		else {
-			str = "# structural object class: ";
-			entroid->structural = cls;
-		}
-		g_string_append(entroid->comment, str);
-		g_string_append(entroid->comment, objectclass_name(cls));
-		g_string_append_c(entroid->comment, '\n');
+/*
+ * Add the closure of a requested class to ENTROID:  list the types new
+ * to it and OR in the closure's bitsets.  A type required by the
+ * closure moves from the entroid's optional to its required types.
+ */
+static void
+entroid_add_closure(tentroid *entroid, tclassinfo *info)
+{
+	tschema *schema = entroid->schema;
+	guint32 *must = MUST_BITS(entroid);
+	guint32 *may = MAY_BITS(entroid);
+	guint32 *cmust = CLOSURE_MUST_BITS(schema, info);
+	guint32 *cmay = CLOSURE_MAY_BITS(schema, info);
+	guint32 newmust = 0, newmay = 0, promoted = 0;
+	int i, j, n;
+
+	for (i = 0; i < BITSET_WORDS(schema); i++) {
+		newmust |= cmust[i] & ~must[i];
+		newmay |= cmay[i] & ~must[i] & ~may[i];
+		promoted |= cmust[i] & may[i];
 	}
-	for (ptr = cls->oc_at_oids_must; ptr && *ptr; ptr++) {
-		LDAPAttributeType *at
-			= entroid_get_attributetype(entroid, *ptr);
-		if (!at) return -1;
-		g_ptr_array_remove(entroid->may, at);
-		adjoin_ptr(entroid->must, at);
+	if (newmust)
+		for (i = 0; i < info->closure_must->len; i++) {
+			LDAPAttributeType *at
+				= g_ptr_array_index(info->closure_must, i);
+			if (!BIT_TEST(must, type_index(schema, at)))
+				g_ptr_array_add(entroid->must, at);
+		}
+	if (newmay)
+		for (i = 0; i < info->closure_may->len; i++) {
+			LDAPAttributeType *at
+				= g_ptr_array_index(info->closure_may, i);
+			n = type_index(schema, at);
+			if (!BIT_TEST(must, n) && !BIT_TEST(may, n))
+				g_ptr_array_add(entroid->may, at);
+		}
+	for (i = 0; i < BITSET_WORDS(schema); i++) {
+		must[i] |= cmust[i];
+		may[i] = (may[i] | cmay[i]) & ~must[i];
 	}
-	for (ptr = cls->oc_at_oids_may; ptr && *ptr; ptr++) {
-		int i;
-		LDAPAttributeType *at
-			= entroid_get_attributetype(entroid, *ptr);
-		if (!at) return -1;
-		for (i = 0; i < entroid->must->len; i++)
-			if (at == g_ptr_array_index(entroid->must, i))
-				break;
-		if (i >= entroid->must->len)
-			g_ptr_array_add(entroid->may, at);
+	if (promoted) {
+		for (i = j = 0; i < entroid->may->len; i++) {
+			LDAPAttributeType *at
+				= g_ptr_array_index(entroid->may, i);
+			if (!BIT_TEST(must, type_index(schema, at)))
+				g_ptr_array_index(entroid->may, j++) = at;
+		}
+		g_ptr_array_set_size(entroid->may, j);
 	}
-	return 0;
 }
 
 /*
@@ -349,17 +954,46 @@ compute_entroid_1(tentroid *entroid, LDAPObjectClass *cls)
  * to the structural objectclass, if any.  Extra trace output for user
  * display in entroid->comment;
  *
+ * The entroid is the union of the closures of the requested classes,
+ * precomputed by close_class().
+ *
  * Return 0 on success, -1 else.
  * Error message, if any, in entroid->error.
  */
 int
 compute_entroid(tentroid *entroid)
 {
-	int i;
+	tschema *schema = entroid->schema;
+	int nrequested = entroid->classes->len;
+	int i, j;
+
+	for (i = 0; i < nrequested; i++) {
+		tclassinfo *info = g_hash_table_lookup(
+			schema->classinfo,
+			g_ptr_array_index(entroid->classes, i));
+		if (info->error) {
+			g_string_assign(entroid->error, info->error);
+			return -1;
+		}
+		for (j = 0; j < info->closure->len; j++)
+			adjoin_ptr(entroid->classes,
+				   g_ptr_array_index(info->closure, j));
+		entroid_add_closure(entroid, info);
+	}
 	for (i = 0; i < entroid->classes->len; i++) {
 		LDAPObjectClass *cls = g_ptr_array_index(entroid->classes, i);
-		if (compute_entroid_1(entroid, cls) == -1)
-			return -1;
+		char *str;
+		if (cls->oc_kind != LDAP_SCHEMA_STRUCTURAL)
+			continue;
+		if (entroid->structural)
+			str = "### WARNING: extra structural object class: ";
+		else {
+			str = "# structural object class: ";
+			entroid->structural = cls;
+		}
+		g_string_append(entroid->comment, str);
+		g_string_append(entroid->comment, objectclass_name(cls));
+		g_string_append_c(entroid->comment, '\n');
 	}
 	if (!entroid->structural)
 		g_string_append(entroid->comment,
@@ -367,3 +1001,93 @@ compute_entroid(tentroid *entroid)
 				" no structural object class specified!\n");
 	return 0;
 }
+
+/*
+ * Number of distinct object class combinations remembered per schema.
+ * Real directories have a few dozen; this only guards against abuse.
+ */
+#define ENTROID_CACHE_SIZE 1024
+
+static int
+compare_names(const void *a, const void *b)
+{
+	return strcmp(*(char **) a, *(char **) b);
+}
+
+static void
+entroid_copy(tentroid *dst, tentroid *src)
+{
+	int i;
+
+	entroid_clear_bits(dst);
+	g_ptr_array_set_size(dst->classes, 0);
+	g_ptr_array_set_size(dst->must, 0);
+	g_ptr_array_set_size(dst->may, 0);
+	for (i = 0; i < src->classes->len; i++)
+		g_ptr_array_add(dst->classes,
+				g_ptr_array_index(src->classes, i));
+	for (i = 0; i < src->must->len; i++)
+		g_ptr_array_add(dst->must, g_ptr_array_index(src->must, i));
+	for (i = 0; i < src->may->len; i++)
+		g_ptr_array_add(dst->may, g_ptr_array_index(src->may, i));
+	memcpy(dst->bits,
+	       src->bits,
+	       3 * BITSET_WORDS(src->schema) * sizeof(guint32));
+	dst->structural = src->structural;
+	g_string_assign(dst->comment, src->comment->str);
+	g_string_assign(dst->error, src->error->str);
+}
+
+/*
+ * Set up ENTROID for an entry with the N object classes NAMES, as if by
+ * entroid_reset(), entroid_request_class() for each name, and
+ * compute_entroid().
+ *
+ * Results are remembered in the schema, keyed by the set of class
+ * names, so that entries sharing their object classes cost no more than
+ * a copy.
+ *
+ * Return 0 on success, -1 else.
+ * Error message, if any, in entroid->error.
+ */
+int
+entroid_set_classes(tentroid *entroid, char **names, int n)
+{
+	GHashTable *cache = entroid->schema->entroids;
+	tentroid *template;
+	char **sorted = xalloc((n + 1) * sizeof(char *));
+	GString *key = g_string_sized_new(0);
+	char *ptr;
+	int i;
+
+	for (i = 0; i < n; i++)
+		sorted[i] = names[i];
+	qsort(sorted, n, sizeof(char *), compare_names);
+	for (i = 0; i < n; i++) {
+		for (ptr = sorted[i]; *ptr; ptr++)
+			g_string_append_c(key, tolower((unsigned char) *ptr));
+		g_string_append_c(key, '\n');
+	}
+	free(sorted);
+
+	if ( (template = g_hash_table_lookup(cache, key->str))) {
+		g_string_free(key, 1);
+		entroid_copy(entroid, template);
+		return entroid->error->len ? -1 : 0;
+	}
+
+	entroid_reset(entroid);
+	for (i = 0; i < n; i++)
+		if (!entroid_request_class(entroid, names[i]))
+			break;
+	if (i == n)
+		compute_entroid(entroid);
+
+	if (g_hash_table_size(cache) < ENTROID_CACHE_SIZE) {
+		template = entroid_new(entroid->schema);
+		entroid_copy(template, entroid);
+		g_hash_table_insert(cache, g_string_free(key, 0), template);
+	} else
+		g_string_free(key, 1);
+	return entroid->error->len ? -1 : 0;
+}
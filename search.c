@@ -100,17 +100,20 @@ handle_result(LDAP *ld, LDAPMessage *result, int start, int n,
 	if (text) ldap_memfree(text);
 }
 
-void
-log_reference(LDAP *ld, LDAPMessage *reference, FILE *s)
+static void
+log_reference(LDAP *ld, LDAPMessage *reference, twriter *w)
 {
         char **refs;
 	char **ptr;
 
         if (ldap_parse_reference(ld, reference, &refs, 0, 0))
 		ldaperr(ld, "ldap_parse_reference");
-	fputc('\n', s);
-	for (ptr = refs; *ptr; ptr++)
-		fprintf(s, "# reference to: %s\n", *ptr);
+	g_string_append_c(w->buf, '\n');
+	for (ptr = refs; *ptr; ptr++) {
+		g_string_append(w->buf, "# reference to: ");
+		g_string_append(w->buf, *ptr);
+		g_string_append_c(w->buf, '\n');
+	}
 	ldap_value_free(refs);
 }
 
@@ -118,110 +121,856 @@ static tentroid *
 entroid_set_message(LDAP *ld, tentroid *entroid, LDAPMessage *entry)
 {
 	struct berval **values = ldap_get_values_len(ld, entry, "objectClass");
-	struct berval **ptr;
+	char **names;
+	int n;
 
 	if (!values || !*values)
 		return 0;
 
-	entroid_reset(entroid);
-	for (ptr = values; *ptr; ptr++) {
-		struct berval *value = *ptr;
-		LDAPObjectClass *cls
-			= entroid_request_class(entroid, value->bv_val);
-		if (!cls) {
-			g_string_append(entroid->comment, "# ERROR: ");
-			g_string_append(entroid->comment, entroid->error->str);
-			ldap_value_free_len(values);
-			return entroid;
-		}
-	}
-	ldap_value_free_len(values);
-
-	if (compute_entroid(entroid) == -1) {
+	for (n = 0; values[n]; n++)
+		;
+	names = xalloc(n * sizeof(char *));
+	for (n = 0; values[n]; n++)
+		names[n] = values[n]->bv_val;
+	if (entroid_set_classes(entroid, names, n) == -1) {
 		g_string_append(entroid->comment, "# ERROR: ");
 		g_string_append(entroid->comment, entroid->error->str);
-		return entroid;
 	}
+	free(names);
+	ldap_value_free_len(values);
 	return entroid;
 }
 
-static void
-search_subtree(FILE *s, LDAP *ld, GArray *offsets, char *base,
-	       cmdline *cmdline, LDAPControl **ctrls, int notty, int ldif,
-	       tschema *schema)
+/*
+ * Return a fresh control array containing CTRLS followed by CONTROL.
+ * Free only the array itself when done, not its elements.
+ */
+LDAPControl **
+controls_with(LDAPControl **ctrls, LDAPControl *control)
+{
+	LDAPControl **result;
+	int n = 0;
+
+	if (ctrls)
+		while (ctrls[n]) n++;
+	result = xalloc((n + 2) * sizeof(LDAPControl *));
+	if (n) memcpy(result, ctrls, n * sizeof(LDAPControl *));
+	result[n] = control;
+	result[n + 1] = 0;
+	return result;
+}
+
+/*
+ * Parse the paged results response control in RESULT, if any, and store
+ * the server's cookie in *COOKIE (freeing the old one).
+ *
+ * Return 1 if the server has another page for us, 0 if the search is
+ * complete or failed.
+ */
+static int
+next_page(LDAP *ld, LDAPMessage *result, struct berval *cookie)
 {
+	int err;
+	LDAPControl **rctrls = 0;
+	LDAPControl *control;
+	ber_int_t estimate;
+	int more = 0;
+
+	if (ldap_parse_result(ld, result, &err, 0, 0, 0, &rctrls, 0))
+		ldaperr(ld, "ldap_parse_result");
+	if (cookie->bv_val) ber_memfree(cookie->bv_val);
+	cookie->bv_val = 0;
+	cookie->bv_len = 0;
+
+	if (err == LDAP_SUCCESS && rctrls
+	    && (control = ldap_control_find(
+			LDAP_CONTROL_PAGEDRESULTS, rctrls, 0)))
+	{
+		if (ldap_parse_pageresponse_control(
+			    ld, control, &estimate, cookie))
+			ldaperr(ld, "ldap_parse_pageresponse_control");
+		more = cookie->bv_len > 0;
+	}
+	if (rctrls) ldap_controls_free(rctrls);
+	return more;
+}
+
+/*
+ * One search request per base DN (or, with --parallel, per partition of
+ * the tree below a base DN).  Requests are sent ahead of time and their
+ * responses multiplexed; messages for a search other than the one
+ * currently being written out are kept in PENDING until it is that
+ * search's turn, so that keys are assigned in the order of the searches,
+ * exactly as with sequential searches.  With paged results, only the head
+ * search asks for its next page right away; the others wait for their
+ * turn after each page, so that no more than a page per search needs to
+ * be buffered.
+ *
+ * Receiving and writing are pipelined: a receiver thread owns the
+ * network side (sending requests, following up on pages, reading
+ * responses in batches) and hands the batches to the main thread
+ * through a bounded queue.  The main thread formats the entries, writes
+ * them and records their offsets.  It never touches the connections;
+ * messages are parsed through a handle of its own, PARSER.  Before a
+ * failed search makes it exit or ask whether to go on, it stops the
+ * receiver (search_stop), which checks for that every SEARCH_POLL
+ * microseconds.
+ */
+typedef struct tconnection {
+	LDAP *ld;
+	GHashTable *msgids;		/* msgid -> tsearch */
+	int active;			/* number of searches in flight */
+	int paused;			/* ... of which waiting for their turn */
+} tconnection;
+
+typedef struct tsearch {
+	char *base;
+	int scope;
+	char *filter;
+	int quiet;			/* don't complain about no results */
+	int banner;			/* announce BASE when it's our turn */
+	int last;			/* final partition of BASE */
+	int index;			/* position in tsearch_context.searches */
+	/* receiver thread: */
+	tconnection *connection;
 	int msgid;
-	LDAPMessage *result, *entry;
-	int start = offsets->len;
-	int n = start;
-	long offset;
+	struct berval cookie;		/* paged results state */
+	int paused;			/* next page not requested yet */
+	/* main thread: */
+	int start;			/* offsets->len when output began */
+	GPtrArray *pending;		/* tbatches received early */
+	int complete;			/* final batch received */
+} tsearch;
+
+/*
+ * A chain of messages for one search, as returned by ldap_result with
+ * LDAP_MSG_RECEIVED.  SEARCH is null for the end marker.
+ */
+typedef struct tbatch {
+	tsearch *search;
+	LDAPMessage *chain;
+	int final;			/* includes the final search result */
+} tbatch;
+
+#define SEARCH_QUEUE_LENGTH 64
+#define SEARCH_POLL 100000
+
+typedef struct tsearch_context {
+	twriter *w;
+	cmdline *cmdline;
+	LDAPControl **ctrls;
+	int notty;
+	int ldif;
+	GArray *offsets;
+	GArray *digests;
 	tentroid *entroid;
-	tentroid *e;
+	tconnection *connections;
+	int nconnections;
+	int window;			/* searches in flight per connection */
+	GPtrArray *searches;
+	volatile gint head;		/* index of the search being written */
+	int next;			/* index of the next search to send */
+	int finished;			/* number of searches completed */
+	GAsyncQueue *batches;		/* receiver -> main thread */
+	GAsyncQueue *tokens;		/* bounds the length of BATCHES */
+	GAsyncQueue *wakeups;		/* main thread -> receiver */
+	GThread *receiver;		/* or null while stopped */
+	volatile gint stop;		/* receiver should return */
+	volatile gint done;		/* receiver has sent the end marker */
+	LDAP *parser;			/* main thread's handle for messages */
+} tsearch_context;
 
-	if (schema)
-		entroid = entroid_new(schema);
-	else
-		entroid = 0;
+static tsearch *
+search_new(char *base, int scope, char *filter, int quiet)
+{
+	tsearch *search = xalloc(sizeof(tsearch));
+	search->base = base ? xdup(base) : 0;
+	search->scope = scope;
+	search->filter = filter ? xdup(filter) : 0;
+	search->quiet = quiet;
+	search->banner = 0;
+	search->last = 0;
+	search->index = 0;
+	search->connection = 0;
+	search->cookie.bv_val = 0;
+	search->cookie.bv_len = 0;
+	search->paused = 0;
+	search->start = 0;
+	search->pending = g_ptr_array_new();
+	search->complete = 0;
+	return search;
+}
+
+static void
+search_free(tsearch *search)
+{
+	if (search->cookie.bv_val)
+		ber_memfree(search->cookie.bv_val);
+	g_ptr_array_free(search->pending, 1);
+	if (search->base) free(search->base);
+	if (search->filter) free(search->filter);
+	free(search);
+}
+
+/*
+ * Send the search request for SEARCH, asking for the next page if
+ * cmdline->pagesize is set.
+ */
+static void
+search_start(tsearch_context *ctx, tsearch *search)
+{
+	cmdline *cmdline = ctx->cmdline;
+	tconnection *connection = search->connection;
+	LDAPControl *page = 0;
+	LDAPControl **ctrls = ctx->ctrls;
 
+	if (cmdline->pagesize) {
+		if (ldap_create_page_control(
+			    connection->ld, cmdline->pagesize,
+			    &search->cookie, 0, &page))
+			ldaperr(connection->ld, "ldap_create_page_control");
+		ctrls = controls_with(ctx->ctrls, page);
+	}
 	if (ldap_search_ext(
-		    ld, base,
-		    cmdline->scope, cmdline->filter, cmdline->attrs,
-		    0, ctrls, 0, 0, 0, &msgid))
-		ldaperr(ld, "ldap_search");
+		    connection->ld, search->base,
+		    search->scope, search->filter, cmdline->attrs,
+		    0, ctrls, 0, 0, 0, &search->msgid))
+		ldaperr(connection->ld, "ldap_search");
+	if (page) {
+		ldap_control_free(page);
+		free(ctrls);
+	}
+	g_hash_table_insert(
+		connection->msgids, GINT_TO_POINTER(search->msgid), search);
+}
+
+/*
+ * Send as many of the remaining searches as the connections will take.
+ * Don't run too far ahead of the head search, since everything received
+ * for later searches needs to be buffered.
+ */
+static void
+search_schedule(tsearch_context *ctx)
+{
+	int limit = g_atomic_int_get(&ctx->head)
+		+ ctx->nconnections * ctx->window * 2;
+
+	while (ctx->next < ctx->searches->len && ctx->next < limit) {
+		tconnection *best = 0;
+		tsearch *search;
+		int i;
+
+		for (i = 0; i < ctx->nconnections; i++) {
+			tconnection *connection = &ctx->connections[i];
+			if (connection->active < ctx->window
+			    && (!best || connection->active < best->active))
+				best = connection;
+		}
+		if (!best)
+			break;
+		search = g_ptr_array_index(ctx->searches, ctx->next++);
+		search->connection = best;
+		best->active++;
+		search_start(ctx, search);
+	}
+}
+
+/*
+ * Request the next page of the head search if it was held back.
+ */
+static void
+search_resume(tsearch_context *ctx)
+{
+	int head = g_atomic_int_get(&ctx->head);
+	tsearch *search;
+
+	if (head >= ctx->searches->len)
+		return;
+	search = g_ptr_array_index(ctx->searches, head);
+	if (search->paused) {
+		search->paused = 0;
+		search->connection->paused--;
+		search_start(ctx, search);
+	}
+}
+
+/*
+ * Wait for the next batch of messages on any of the connections.
+ * Returns null if there is none after SEARCH_POLL microseconds.
+ */
+static LDAPMessage *
+search_wait(tsearch_context *ctx, tconnection **result)
+{
+	struct timeval zero = {0, 0};
+	struct timeval timeout = {0, SEARCH_POLL};
+	LDAPMessage *chain;
+	int i;
+
+	if (ctx->nconnections == 1) {
+		*result = ctx->connections;
+		switch (ldap_result(ctx->connections->ld, LDAP_RES_ANY,
+				    LDAP_MSG_RECEIVED, &timeout, &chain))
+		{
+		case -1:
+			ldaperr(ctx->connections->ld, "ldap_result");
+		case 0:
+			return 0;
+		default:
+			return chain;
+		}
+	}
+
+	for (;;) {
+		fd_set fds;
+		int maxfd = -1;
+
+		FD_ZERO(&fds);
+		for (i = 0; i < ctx->nconnections; i++) {
+			tconnection *connection = &ctx->connections[i];
+			int fd;
 
-	while (n >= 0)
-		switch (ldap_result(ld, msgid, 0, 0, &result)) {
+			if (connection->active == connection->paused)
+				continue;
+			switch (ldap_result(connection->ld, LDAP_RES_ANY,
+					    LDAP_MSG_RECEIVED, &zero, &chain))
+			{
+			case -1:
+				ldaperr(connection->ld, "ldap_result");
+			case 0:
+				break;
+			default:
+				*result = connection;
+				return chain;
+			}
+			if (ldap_get_option(connection->ld, LDAP_OPT_DESC, &fd))
+				ldaperr(connection->ld,
+					"ldap_get_option(LDAP_OPT_DESC)");
+			FD_SET(fd, &fds);
+			if (fd > maxfd) maxfd = fd;
+		}
+		if (maxfd == -1) abort();
+		switch (select(maxfd + 1, &fds, 0, 0, &timeout)) {
+		case -1:
+			if (errno != EINTR) syserr();
+			break;
+		case 0:
+			return 0;
+		}
+	}
+}
+
+/*
+ * Receiver thread: queue BATCH for the main thread, waiting while the
+ * queue is full.  If the main thread wants us to stop meanwhile, queue
+ * it anyway rather than lose it.
+ */
+static void
+search_push(tsearch_context *ctx, tbatch *batch)
+{
+	while (!g_async_queue_timeout_pop(ctx->tokens, SEARCH_POLL))
+		if (g_atomic_int_get(&ctx->stop))
+			break;
+	g_async_queue_push(ctx->batches, batch);
+}
+
+/*
+ * Receiver thread: find the search CHAIN belongs to, follow up on paged
+ * results, and queue the batch for the main thread.
+ */
+static void
+search_route(tsearch_context *ctx, tconnection *connection,
+	     LDAPMessage *chain)
+{
+	LDAP *ld = connection->ld;
+	int msgid = ldap_msgid(chain);
+	tsearch *search = g_hash_table_lookup(
+		connection->msgids, GINT_TO_POINTER(msgid));
+	tbatch *batch;
+	LDAPMessage *msg;
+
+	if (msgid == 0) {
+		/* unsolicited notification, e.g. notice of disconnection */
+		char *text = 0;
+		int err;
+
+		if (ldap_parse_result(ld, chain, &err, 0, &text, 0, 0, 1))
+			ldaperr(ld, "ldap_parse_result");
+		fprintf(stderr, "Notice from server: %s (%d)\n",
+			ldap_err2string(err), err);
+		if (text && *text)
+			fprintf(stderr, "\tadditional info: %s\n", text);
+		if (text) ldap_memfree(text);
+		return;
+	}
+	if (!search) {
+		fprintf(stderr,
+			"Error: Response to unknown request %d ignored.\n",
+			msgid);
+		ldap_msgfree(chain);
+		return;
+	}
+	batch = xalloc(sizeof(tbatch));
+	batch->search = search;
+	batch->chain = chain;
+	batch->final = 0;
+
+	for (msg = ldap_first_message(ld, chain);
+	     msg;
+	     msg = ldap_next_message(ld, msg))
+		if (ldap_msgtype(msg) == LDAP_RES_SEARCH_RESULT)
+			break;
+	if (msg) {
+		g_hash_table_remove(connection->msgids, GINT_TO_POINTER(msgid));
+		if (ctx->cmdline->pagesize
+		    && next_page(ld, msg, &search->cookie))
+		{
+			if (search->index == g_atomic_int_get(&ctx->head))
+				search_start(ctx, search);
+			else {
+				/* see search_resume() */
+				search->paused = 1;
+				connection->paused++;
+			}
+		} else {
+			batch->final = 1;
+			connection->active--;
+			ctx->finished++;
+		}
+	}
+
+	search_push(ctx, batch);
+}
+
+static gpointer
+search_receiver(gpointer data)
+{
+	tsearch_context *ctx = data;
+	tbatch *end;
+	tconnection *connection;
+	LDAPMessage *chain;
+	int i;
+
+	while (!g_atomic_int_get(&ctx->stop)) {
+		int active = 0;
+
+		search_schedule(ctx);
+		search_resume(ctx);
+		if (ctx->finished == ctx->searches->len) {
+			end = xalloc(sizeof(tbatch));
+			end->search = 0;
+			g_atomic_int_set(&ctx->done, 1);
+			search_push(ctx, end);
+			break;
+		}
+		for (i = 0; i < ctx->nconnections; i++)
+			active += ctx->connections[i].active
+				- ctx->connections[i].paused;
+		if (!active) {
+			/* too far ahead of the main thread */
+			g_async_queue_timeout_pop(ctx->wakeups, SEARCH_POLL);
+			continue;
+		}
+		if ( (chain = search_wait(ctx, &connection)))
+			search_route(ctx, connection, chain);
+	}
+	return 0;
+}
+
+static void
+search_continue(tsearch_context *ctx)
+{
+	g_atomic_int_set(&ctx->stop, 0);
+	ctx->receiver = g_thread_new("receiver", search_receiver, ctx);
+}
+
+/*
+ * Main thread: make the receiver return and wait for it.
+ */
+static void
+search_stop(tsearch_context *ctx)
+{
+	g_atomic_int_set(&ctx->stop, 1);
+	g_thread_join(ctx->receiver);
+	ctx->receiver = 0;
+}
+
+/*
+ * Write MSG, which belongs to the search currently at the head.
+ */
+static void
+search_emit(tsearch_context *ctx, tsearch *search, LDAPMessage *msg)
+{
+	LDAP *ld = ctx->parser;
+	int n = ctx->offsets->len;
+	long offset;
+	tentroid *e;
+
+	switch (ldap_msgtype(msg)) {
+	case LDAP_RES_SEARCH_ENTRY:
+		offset = writer_tell(ctx->w);
+		if (offset == -1 && !ctx->notty) syserr();
+		g_array_append_val(ctx->offsets, offset);
+		if (ctx->entroid)
+			e = entroid_set_message(ld, ctx->entroid, msg);
+		else
+			e = 0;
+		if (ctx->ldif)
+			print_ldif_message(
+				ctx->w, ld, msg, ctx->notty ? -1 : n, e);
+		else
+			print_ldapvi_message(ctx->w, ld, msg, n, e);
+		if (ctx->digests && n == 0)
+			/* digests start after an entry's first newline */
+			writer_start_digests(ctx->w, offset + 1);
+		else if (ctx->w->hashing) {
+			/* the previous entry ends with our first newline */
+			tdigest d;
+			d.offset = g_array_index(ctx->offsets, long, n - 1);
+			d.length = offset - d.offset;
+			d.hash = writer_digest(ctx->w, offset + 1);
+			g_array_append_val(ctx->digests, d);
+		}
+		n++;
+		if (!ctx->cmdline->quiet && !ctx->notty)
+			update_progress(ld, n, msg);
+		break;
+	case LDAP_RES_SEARCH_REFERENCE:
+		log_reference(ld, msg, ctx->w);
+		break;
+	case LDAP_RES_SEARCH_RESULT:
+		/* handle_result() might exit */
+		writer_flush(ctx->w);
+		if (!ctx->notty && search->last) {
+			update_progress(ld, n, 0);
+			putchar('\n');
+		}
+		/* ... or ask questions */
+		if (ldap_result2error(ld, msg, 0) && ctx->receiver)
+			search_stop(ctx);
+		handle_result(ld, msg, search->start, n,
+			      !ctx->cmdline->quiet && !search->quiet,
+			      ctx->notty);
+		if (!ctx->receiver && !g_atomic_int_get(&ctx->done))
+			search_continue(ctx);
+		break;
+	default:
+		abort();
+	}
+}
+
+/*
+ * Write the messages in BATCH, which belongs to the head search, and
+ * free it.  Intermediate page results are skipped.
+ */
+static void
+search_emit_batch(tsearch_context *ctx, tbatch *batch)
+{
+	LDAP *ld = ctx->parser;
+	LDAPMessage *msg;
+
+	for (msg = ldap_first_message(ld, batch->chain);
+	     msg;
+	     msg = ldap_next_message(ld, msg))
+		if (batch->final || ldap_msgtype(msg) != LDAP_RES_SEARCH_RESULT)
+			search_emit(ctx, batch->search, msg);
+	writer_commit(ctx->w);
+	ldap_msgfree(batch->chain);
+	free(batch);
+}
+
+/*
+ * SEARCH is now at the head.
+ */
+static void
+search_begin(tsearch_context *ctx, tsearch *search)
+{
+	search->start = ctx->offsets->len;
+	if (search->banner)
+		fprintf(stderr, "Searching in: %s\n", search->base);
+}
+
+/*
+ * The head search is complete.  Move on to the next one, writing out
+ * whatever it has received in the meantime.
+ */
+static void
+search_advance(tsearch_context *ctx)
+{
+	while (ctx->head + 1 < ctx->searches->len) {
+		tsearch *search;
+		int i;
+
+		g_atomic_int_set(&ctx->head, ctx->head + 1);
+		g_async_queue_push(ctx->wakeups, ctx);
+		search = g_ptr_array_index(ctx->searches, ctx->head);
+		search_begin(ctx, search);
+		for (i = 0; i < search->pending->len; i++)
+			search_emit_batch(
+				ctx, g_ptr_array_index(search->pending, i));
+		g_ptr_array_set_size(search->pending, 0);
+		if (!search->complete)
+			return;
+	}
+	g_atomic_int_set(&ctx->head, ctx->searches->len);
+}
+
+/*
+ * Main thread: write BATCH out if its search is at the head, or keep
+ * it for later.
+ */
+static void
+search_deliver(tsearch_context *ctx, tbatch *batch)
+{
+	tsearch *search = batch->search;
+
+	if (batch->final)
+		search->complete = 1;
+	if (search == g_ptr_array_index(ctx->searches, ctx->head)) {
+		search_emit_batch(ctx, batch);
+		if (search->complete)
+			search_advance(ctx);
+	} else
+		g_ptr_array_add(search->pending, batch);
+}
+
+/*
+ * Run SEARCHES on CONNECTIONS and append the entries to S, noting their
+ * positions in OFFSETS.  If DIGESTS is non-null, also note a tdigest for
+ * each entry but the last.
+ *
+ * With cmdline->pagesize, use the simple paged results control (RFC 2696)
+ * and repeat each search with the cookie returned by the server until all
+ * pages have been received.  Entries of the search being written are
+ * freed as they arrive.
+ */
+static void
+search_all(FILE *s, tconnection *connections, int nconnections, int window,
+	   GArray *offsets, GArray *digests, GPtrArray *searches,
+	   cmdline *cmdline, LDAPControl **ctrls, int notty, int ldif,
+	   tschema *schema)
+{
+	tsearch_context ctx;
+	tbatch *batch;
+	int i;
+	int rc;
+
+	ctx.w = writer_new(s);
+	ctx.cmdline = cmdline;
+	ctx.ctrls = ctrls;
+	ctx.notty = notty;
+	ctx.ldif = ldif;
+	ctx.offsets = offsets;
+	ctx.digests = digests;
+	ctx.entroid = schema ? entroid_new(schema) : 0;
+	ctx.connections = connections;
+	ctx.nconnections = nconnections;
+	ctx.window = window;
+	ctx.searches = searches;
+	ctx.head = 0;
+	ctx.next = 0;
+	ctx.finished = 0;
+	ctx.batches = g_async_queue_new();
+	ctx.tokens = g_async_queue_new();
+	ctx.wakeups = g_async_queue_new();
+	ctx.stop = 0;
+	ctx.done = 0;
+	if ( (rc = ldap_initialize(&ctx.parser, 0))) {
+		fprintf(stderr, "ldap_initialize: %s\n", ldap_err2string(rc));
+		exit(1);
+	}
+	for (i = 0; i < SEARCH_QUEUE_LENGTH; i++)
+		g_async_queue_push(ctx.tokens, &ctx);
+
+	for (i = 0; i < searches->len; i++)
+		((tsearch *) g_ptr_array_index(searches, i))->index = i;
+	if (searches->len)
+		search_begin(&ctx, g_ptr_array_index(searches, 0));
+	search_continue(&ctx);
+	while ( (batch = g_async_queue_pop(ctx.batches))->search) {
+		g_async_queue_push(ctx.tokens, &ctx);
+		search_deliver(&ctx, batch);
+	}
+	free(batch);
+	if (ctx.receiver)
+		search_stop(&ctx);
+	ldap_unbind_s(ctx.parser);
+	if (ctx.w->hashing) {
+		/* the last entry ends with the file */
+		tdigest d;
+		long end = writer_tell(ctx.w);
+		d.offset = g_array_index(offsets, long, offsets->len - 1);
+		d.length = end - d.offset - 1;
+		d.hash = writer_digest(ctx.w, end);
+		g_array_append_val(digests, d);
+	}
+	writer_free(ctx.w);
+
+	for (i = 0; i < searches->len; i++)
+		search_free(g_ptr_array_index(searches, i));
+	g_async_queue_unref(ctx.batches);
+	g_async_queue_unref(ctx.tokens);
+	g_async_queue_unref(ctx.wakeups);
+	if (ctx.entroid)
+		entroid_free(ctx.entroid);
+}
+
+/*
+ * Return FILTER, parenthesized if necessary, as a newly allocated string.
+ */
+static char *
+filter_component(char *filter)
+{
+	if (!filter)
+		return g_strdup("(objectclass=*)");
+	if (*filter == '(')
+		return g_strdup(filter);
+	return g_strdup_printf("(%s)", filter);
+}
+
+/*
+ * Partition the subtree search below BASE using the first character of
+ * attribute AD.  Each partition excludes the values matched by its
+ * predecessors, so that an entry with several values of AD is found only
+ * once, and a final partition catches everything else.
+ *
+ * Substring filters on an attribute without a SUBSTR matching rule are
+ * Undefined, and so are their negations, so entries with such an
+ * attribute would match no partition at all.  Return -1 if SCHEMA does
+ * not show that AD has one.
+ */
+static int
+partition_by_attribute(GPtrArray *searches, char *base, char *ad,
+		       cmdline *cmdline, tschema *schema)
+{
+	static char prefixes[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+	char *filter;
+	GString *exclude;
+	char *f;
+	int i;
+
+	if (!schema || !schema_substr_p(schema, ad)) {
+		fprintf(stderr,
+			"Warning: Cannot partition %s by %s:"
+			" no substring matching rule in the schema\n",
+			base ? base : "", ad);
+		return -1;
+	}
+	filter = filter_component(cmdline->filter);
+	exclude = g_string_new("");
+	for (i = 0; prefixes[i]; i++) {
+		f = g_strdup_printf(
+			"(&%s(%s=%c*)%s)", filter, ad, prefixes[i],
+			exclude->str);
+		g_ptr_array_add(searches,
+				search_new(base, cmdline->scope, f, 1));
+		g_free(f);
+		g_string_append_printf(exclude, "(!(%s=%c*))", ad, prefixes[i]);
+	}
+	f = g_strdup_printf("(&%s%s)", filter, exclude->str);
+	g_ptr_array_add(searches, search_new(base, cmdline->scope, f, 1));
+	g_free(f);
+	g_string_free(exclude, 1);
+	g_free(filter);
+	return 0;
+}
+
+/*
+ * Partition the subtree search below BASE into a base search for BASE
+ * itself and one subtree search per immediate child.  Return -1 if the
+ * children could not be enumerated.
+ *
+ * At most PARTITION_CHILDREN_MAX children are listed.  If there are more,
+ * the tree is flat at this level and most children are probably leaves,
+ * so a search per child would cost more than it saves.  Partition by the
+ * naming attribute of the children instead, as with --partition.
+ */
+#define PARTITION_CHILDREN_MAX 256
+
+static int
+partition_by_children(GPtrArray *searches, LDAP *ld, char *base,
+		      cmdline *cmdline, LDAPControl **ctrls, tschema *schema)
+{
+	char *attrs[] = {LDAP_NO_ATTRS, 0};
+	LDAPMessage *result, *entry;
+	GPtrArray *children = g_ptr_array_new();
+	int msgid;
+	int err;
+	int rc;
+	int i;
+
+	if (ldap_search_ext(ld, base, LDAP_SCOPE_ONELEVEL, 0, attrs, 1,
+			    ctrls, 0, 0, PARTITION_CHILDREN_MAX + 1, &msgid))
+		ldaperr(ld, "ldap_search");
+	for (;;) {
+		switch (ldap_result(ld, msgid, LDAP_MSG_ONE, 0, &result)) {
 		case -1:
 		case 0:
 			ldaperr(ld, "ldap_result");
 		case LDAP_RES_SEARCH_ENTRY:
 			entry = ldap_first_entry(ld, result);
-			offset = ftell(s);
-			if (offset == -1 && !notty) syserr();
-			g_array_append_val(offsets, offset);
-			if (entroid)
-				e = entroid_set_message(ld, entroid, entry);
-			else
-				e = 0;
-			if (ldif)
-				print_ldif_message(
-					s, ld, entry, notty ? -1 : n, e);
-			else
-				print_ldapvi_message(s, ld, entry, n, e);
-			n++;
-			if (!cmdline->quiet && !notty)
-				update_progress(ld, n, entry);
-			ldap_msgfree(entry);
-			break;
+			g_ptr_array_add(children, ldap_get_dn(ld, entry));
+			ldap_msgfree(result);
+			continue;
 		case LDAP_RES_SEARCH_REFERENCE:
-			log_reference(ld, result, s);
 			ldap_msgfree(result);
-			break;
+			continue;
 		case LDAP_RES_SEARCH_RESULT:
-			if (!notty) {
-				update_progress(ld, n, 0);
-				putchar('\n');
-			}
-			handle_result(ld, result, start, n, !cmdline->quiet,
-				      notty);
-			n = -1;
-			ldap_msgfree(result);
 			break;
 		default:
 			abort();
 		}
-	if (entroid)
-		entroid_free(entroid);
+		break;
+	}
+	if (ldap_parse_result(ld, result, &err, 0, 0, 0, 0, 1))
+		ldaperr(ld, "ldap_parse_result");
+
+	if (err == LDAP_SUCCESS) {
+		g_ptr_array_add(searches,
+				search_new(base, LDAP_SCOPE_BASE,
+					   cmdline->filter, 1));
+		for (i = 0; i < children->len; i++)
+			g_ptr_array_add(searches,
+					search_new(g_ptr_array_index(
+							   children, i),
+						   LDAP_SCOPE_SUBTREE,
+						   cmdline->filter,
+						   1));
+		rc = 0;
+	} else if (err == LDAP_SIZELIMIT_EXCEEDED && children->len) {
+		char *dn = g_ptr_array_index(children, 0);
+		char *ad = g_strndup(dn, strcspn(dn, "="));
+		rc = partition_by_attribute(
+			searches, base, ad, cmdline, schema);
+		g_free(ad);
+	} else {
+		fprintf(stderr,
+			"Warning: Cannot partition %s: %s\n",
+			base ? base : "", ldap_err2string(err));
+		rc = -1;
+	}
+
+	for (i = 0; i < children->len; i++)
+		ldap_memfree(g_ptr_array_index(children, i));
+	g_ptr_array_free(children, 1);
+	return rc;
 }
 
 GArray *
 search(FILE *s, LDAP *ld, cmdline *cmdline, LDAPControl **ctrls, int notty,
-       int ldif)
+       int ldif, GArray *digests)
 {
 	GArray *offsets = g_array_new(0, 0, sizeof(long));
 	GPtrArray *basedns = cmdline->basedns;
-	int i;
+	GPtrArray *searches = g_ptr_array_new();
+	tconnection *connections;
+	int nconnections;
 	tschema *schema;
+	tschema *types = 0;
+	int partition = cmdline->parallel > 1;
+	char *nobase = 0;
+	char **bases;
+	int nbases;
+	int i;
 
 	if (cmdline->schema_comments) {
 		schema = schema_new(ld);
@@ -233,17 +982,71 @@ search(FILE *s, LDAP *ld, cmdline *cmdline, LDAPControl **ctrls, int notty,
 	} else
 		schema = 0;
 
-	if (basedns->len == 0)
-		search_subtree(s, ld, offsets, 0, cmdline, ctrls, notty, ldif,
-			       schema);
-	else
-		for (i = 0; i < basedns->len; i++) {
-			char *base = g_ptr_array_index(basedns, i);
-			if (!cmdline->quiet && (basedns->len > 1))
-				fprintf(stderr, "Searching in: %s\n", base);
-			search_subtree(s, ld, offsets, base, cmdline, ctrls,
-				       notty, ldif, schema);
-		}
+	if (partition && cmdline->sortkeys) {
+		fputs("Warning: With --sort, searches are not partitioned,"
+		      " so that the order is global.\n",
+		      stderr);
+		partition = 0;
+	}
+	if (partition)
+		types = schema ? schema : schema_new(ld);
+
+	if (basedns->len == 0) {
+		bases = &nobase;
+		nbases = 1;
+	} else {
+		bases = (char **) basedns->pdata;
+		nbases = basedns->len;
+	}
+	for (i = 0; i < nbases; i++) {
+		int first = searches->len;
+		int rc = -1;
+
+		if (!partition)
+			;
+		else if (cmdline->partition)
+			rc = partition_by_attribute(searches, bases[i],
+						    cmdline->partition,
+						    cmdline, types);
+		else if (cmdline->scope == LDAP_SCOPE_SUBTREE)
+			rc = partition_by_children(searches, ld, bases[i],
+						   cmdline, ctrls, types);
+		if (rc == -1)
+			g_ptr_array_add(searches,
+					search_new(bases[i], cmdline->scope,
+						   cmdline->filter, 0));
+		if (!cmdline->quiet && nbases > 1)
+			((tsearch *) g_ptr_array_index(searches, first))
+				->banner = 1;
+		((tsearch *) g_ptr_array_index(searches, searches->len - 1))
+			->last = 1;
+	}
+	if (types && types != schema)
+		schema_free(types);
+
+	nconnections = cmdline->parallel > 1 ? cmdline->parallel : 1;
+	connections = xalloc(nconnections * sizeof(tconnection));
+	for (i = 0; i < nconnections; i++) {
+		connections[i].ld = i ? connect_quietly(cmdline) : ld;
+		connections[i].msgids
+			= g_hash_table_new(g_direct_hash, g_direct_equal);
+		connections[i].active = 0;
+		connections[i].paused = 0;
+	}
+
+	/* Without --parallel, send all searches on the main connection at
+	 * once.  Otherwise, give each connection one partition at a time. */
+	search_all(s, connections, nconnections,
+		   nconnections > 1 ? 1 : searches->len,
+		   offsets, digests, searches, cmdline, ctrls, notty, ldif,
+		   schema);
+
+	for (i = 0; i < nconnections; i++) {
+		if (i) ldap_unbind_s(connections[i].ld);
+		g_hash_table_destroy(connections[i].msgids);
+	}
+	free(connections);
+	g_ptr_array_free(searches, 1);
 
 	if (!offsets->len) {
 		if (!cmdline->noninteractive) {